@@ -10,6 +10,7 @@ Usage:
   $0 [OPTIONS] create [MOUNTPOINT_PATH] [DEV_NAME] - Create a new DDI device mounted at MOUNTPOINT_PATH with optional name DEV_NAME
   $0 delete MOUNTPOINT_PATH|DEV_PATH               - Delete a previously setup DDI device indicated either by mountpoint or by its path
   $0 clean                                         - Cleanup kernel module loaded by this program
+  $0 top [INTERVAL]                                - Show per-second I/O and latency of all DDI devices every INTERVAL seconds (default: 1)
 Options:
   -h - Show this help
   -u - Skip mounting created device and print its path instead
@@ -61,6 +62,7 @@ shift $((OPTIND-1))
 subcmd="$1"
 mountpoint="$2"
 dev_name="$3"
+interval="${2:-1}"
 
 function do_create() {
     if [ $skip_mount = 0 ] && [ -z "$mountpoint" ]; then
@@ -144,6 +146,61 @@ function do_delete() {
     fi
 }
 
+# Prints one line per direction of the DDI device at $1:
+# NAME DIR OPS BYTES DELAYED HOLD_COUNT HOLD_SUM_US QUEUED DELAY_MS
+function top_sample() {
+    local d="$1"
+    awk -v name="$(basename "$d")" -v rd="$(cat "$d/read_delay")" -v wd="$(cat "$d/write_delay")" '
+        FILENAME ~ /\/stats$/ && ($1 == "read" || $1 == "write") { ops[$1] = $2; bytes[$1] = $3; delayed[$1] = $4 }
+        FILENAME ~ /latency_histogram$/ && $2 == "hold" && $3 == "count" { cnt[$1] = $4; sum[$1] = $14 }
+        FILENAME ~ /\/queue$/ { depth[$1] = $2 }
+        END {
+            print name, "read", ops["read"], bytes["read"], delayed["read"], cnt["read"] + 0, sum["read"] + 0, depth["read"] + 0, rd
+            print name, "write", ops["write"], bytes["write"], delayed["write"], cnt["write"] + 0, sum["write"] + 0, depth["write"] + 0, wd
+        }' "$d/stats" "$d/latency_histogram" "$d/queue"
+}
+
+function do_top() {
+    if ! [[ "$interval" =~ ^[0-9]*\.?[0-9]+$ ]] || ! awk -v i="$interval" 'BEGIN { exit !(i > 0) }'; then
+        echo "Error: INTERVAL must be a positive number of seconds" >&2
+        show_help
+        return 1
+    fi
+    local tmp_dir=$(mktemp -d /tmp/ddi-top-XXXXX)
+    trap "rm -rf '$tmp_dir'" EXIT
+
+    local prev_time cur_time d
+    : >"$tmp_dir/prev"
+    prev_time=$(date +%s.%N)
+    while true; do
+        sleep "$interval"
+        cur_time=$(date +%s.%N)
+        for d in /sys/fs/ddi/*/; do
+            if [ -f "$d/stats" ]; then
+                top_sample "$d"
+            fi
+        done >"$tmp_dir/cur"
+
+        if [ -t 1 ]; then
+            printf '\033[H\033[2J'
+        fi
+        # Achieved latency is the mean time bios were held over the interval,
+        # including those passed through undelayed.
+        awk -v dt="$(echo "$cur_time $prev_time" | awk '{ print $1 - $2 }')" '
+            BEGIN { printf "%-16s %-5s %8s %9s %8s %7s %9s %9s\n", "DEVICE", "DIR", "IOPS", "MiB/s", "DELAYED%", "QUEUED", "CONF_MS", "HOLD_MS" }
+            NR == FNR { prev[$1 " " $2] = $0; next }
+            ($1 " " $2) in prev {
+                split(prev[$1 " " $2], p)
+                ops = $3 - p[3]; cnt = $6 - p[6]
+                printf "%-16s %-5s %8.0f %9.2f %8.1f %7d %9d %9.1f\n", $1, $2, ops / dt, ($4 - p[4]) / dt / 1048576,
+                       ops > 0 ? 100 * ($5 - p[5]) / ops : 0, $8, $9, cnt > 0 ? ($7 - p[7]) / cnt / 1000 : 0
+            }' "$tmp_dir/prev" "$tmp_dir/cur"
+
+        mv "$tmp_dir/cur" "$tmp_dir/prev"
+        prev_time="$cur_time"
+    done
+}
+
 function do_clean() {
     if module_loaded; then
         echo "Unloading dm-ddi module" >&2
@@ -161,6 +218,9 @@ case "$subcmd" in
     clean)
         do_clean
         ;;
+    top)
+        do_top
+        ;;
     *)
         if [ -n "$subcmd" ]; then
             echo "Error: no such subcommand: $subcommand" >&2
@@ -0,0 +1,49 @@
+/*
+ * Binary I/O record stream of ddi - Disk Delay Injection.
+ *
+ * This file is released under the GPL.
+ *
+ * While record mode is on, a record is written for every completed bio to a
+ * ring buffer of the CPU it completed on. Userspace maps
+ * /sys/kernel/debug/ddi/<dev>/records, which holds one area per possible CPU,
+ * each DDI_RING_HEADER_SIZE bytes of struct ddi_ring_header followed by
+ * nr_records records:
+ *
+ *   offset(cpu) = cpu * (DDI_RING_HEADER_SIZE + nr_records * record_size)
+ *
+ * The kernel only advances head and userspace only advances tail; record
+ * i lives at index i & (nr_records - 1). Records that do not fit are
+ * counted in drops instead of waiting for userspace.
+ */
+#ifndef DM_DDI_RECORD_H
+#define DM_DDI_RECORD_H
+
+#include <linux/types.h>
+
+#define DDI_RING_HEADER_SIZE 4096
+
+struct ddi_ring_header {
+	__u64 head;
+	__u64 tail;
+	__u64 drops;
+	__u32 nr_records;
+	__u32 record_size;
+};
+
+/* Times are CLOCK_MONOTONIC nanoseconds. */
+struct ddi_record {
+	__u64 queued_ns;
+	__u64 dispatched_ns;
+	__u64 completed_ns;
+	__u64 sector;
+	__u32 bytes;
+	__u32 delay_ms;
+	__u32 opf;
+	__u32 pid;
+	__s32 error;
+	__u16 op;	/* read, write, flush, discard, write_zeroes */
+	__u16 dir;
+	__u64 reserved;
+};
+
+#endif /* DM_DDI_RECORD_H */
@@ -0,0 +1,125 @@
+/*
+ * Tracepoints for ddi - Disk Delay Injection.
+ *
+ * This file is released under the GPL.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ddi
+
+#if !defined(_TRACE_DM_DDI_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_DM_DDI_H
+
+#include <linux/tracepoint.h>
+#include <linux/blk_types.h>
+
+#define show_ddi_op(op)						\
+	__print_symbolic(op,					\
+		{ REQ_OP_READ,		"read" },		\
+		{ REQ_OP_WRITE,		"write" },		\
+		{ REQ_OP_FLUSH,		"flush" },		\
+		{ REQ_OP_DISCARD,	"discard" },		\
+		{ REQ_OP_SECURE_ERASE,	"secure_erase" },	\
+		{ REQ_OP_WRITE_ZEROES,	"write_zeroes" })
+
+DECLARE_EVENT_CLASS(ddi_bio,
+
+	TP_PROTO(dev_t dev, sector_t sector, unsigned int bytes, unsigned int op,
+		 unsigned int delay, u64 held, unsigned int depth),
+
+	TP_ARGS(dev, sector, bytes, op, delay, held, depth),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(sector_t,	sector)
+		__field(unsigned int,	bytes)
+		__field(unsigned int,	op)
+		__field(unsigned int,	delay)
+		__field(u64,		held)
+		__field(unsigned int,	depth)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dev;
+		__entry->sector	= sector;
+		__entry->bytes	= bytes;
+		__entry->op	= op;
+		__entry->delay	= delay;
+		__entry->held	= held;
+		__entry->depth	= depth;
+	),
+
+	TP_printk("%d,%d %s %llu + %u delay=%ums held=%lluns depth=%u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  show_ddi_op(__entry->op),
+		  (unsigned long long)__entry->sector, __entry->bytes >> 9,
+		  __entry->delay, (unsigned long long)__entry->held,
+		  __entry->depth)
+);
+
+/*
+ * A bio entered delay_bio(); held is always 0. Bios passed straight
+ * through report delay 0 and get no ddi_dispatch event.
+ */
+DEFINE_EVENT(ddi_bio, ddi_enqueue,
+
+	TP_PROTO(dev_t dev, sector_t sector, unsigned int bytes, unsigned int op,
+		 unsigned int delay, u64 held, unsigned int depth),
+
+	TP_ARGS(dev, sector, bytes, op, delay, held, depth)
+);
+
+/* A queued bio was released by flush_delayed_bios(). */
+DEFINE_EVENT(ddi_bio, ddi_dispatch,
+
+	TP_PROTO(dev_t dev, sector_t sector, unsigned int bytes, unsigned int op,
+		 unsigned int delay, u64 held, unsigned int depth),
+
+	TP_ARGS(dev, sector, bytes, op, delay, held, depth)
+);
+
+TRACE_EVENT(ddi_complete,
+
+	TP_PROTO(dev_t dev, sector_t sector, unsigned int bytes, unsigned int op,
+		 unsigned int delay, u64 held, u64 service, int error),
+
+	TP_ARGS(dev, sector, bytes, op, delay, held, service, error),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(sector_t,	sector)
+		__field(unsigned int,	bytes)
+		__field(unsigned int,	op)
+		__field(unsigned int,	delay)
+		__field(u64,		held)
+		__field(u64,		service)
+		__field(int,		error)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->sector		= sector;
+		__entry->bytes		= bytes;
+		__entry->op		= op;
+		__entry->delay		= delay;
+		__entry->held		= held;
+		__entry->service	= service;
+		__entry->error		= error;
+	),
+
+	TP_printk("%d,%d %s %llu + %u delay=%ums held=%lluns service=%lluns error=%d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  show_ddi_op(__entry->op),
+		  (unsigned long long)__entry->sector, __entry->bytes >> 9,
+		  __entry->delay, (unsigned long long)__entry->held,
+		  (unsigned long long)__entry->service, __entry->error)
+);
+
+#endif /* _TRACE_DM_DDI_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dm-ddi-trace
+#include <trace/define_trace.h>
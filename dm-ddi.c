@@ -18,11 +18,302 @@
 #include <linux/blkdev.h>
 #include <linux/bio.h>
 #include <linux/slab.h>
+#include <linux/ioprio.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/rcupdate.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/dm-ioctl.h>
 
 #include <linux/device-mapper.h>
 
+#define CREATE_TRACE_POINTS
+#include "dm-ddi-trace.h"
+#include "dm-ddi-record.h"
+
 #define DM_MSG_PREFIX "ddi"
 
+/* I/O priority classes (none, rt, be, idle) and levels per class. */
+#define DDI_IOPRIO_CLASSES 4
+#define DDI_IOPRIO_LEVELS 8
+/* Entry value in ioprio_delay meaning "use the per-direction delay". */
+#define DDI_IOPRIO_INHERIT (-1)
+
+/* Written bytes a CPU accumulates locally before folding them into gc_written. */
+#define DDI_GC_BATCH (256 * 1024)
+
+/* Read cache tracker geometry: ways per set and bounds of tracked extents. */
+#define DDI_RCACHE_WAYS 4
+#define DDI_RCACHE_MAX_EXTENTS (1U << 22)
+#define DDI_RCACHE_DEFAULT_EXTENT_KB 64
+
+/*
+ * A set of the read cache tracker. Tags are extent numbers plus one so that
+ * zero marks an empty way. Victims are chosen per set with CLOCK over refs.
+ */
+struct rcache_set {
+	u64 tags[DDI_RCACHE_WAYS];
+	u8 refs;
+	u8 hand;
+};
+
+struct rcache {
+	struct rcu_head rcu;
+	unsigned extent_shift;
+	unsigned set_bits;
+	struct rcache_set sets[];
+};
+
+/* Per-CPU record rings in one user-mappable buffer, see dm-ddi-record.h. */
+struct ddi_ring {
+	void *buf;
+	size_t stride;
+	unsigned nr_records;
+};
+
+struct rcache_stats {
+	u64 hits;
+	u64 misses;
+};
+
+/*
+ * Log-linear latency histogram in microseconds, in the style of HDR
+ * histograms: values below 2 * DDI_HIST_SUB have a bucket each, every power
+ * of two above that is split in DDI_HIST_SUB buckets (12.5% precision).
+ * Values of 2^DDI_HIST_MAX_BITS us (~18 minutes) and more share the last one.
+ */
+#define DDI_HIST_SUB_BITS 3
+#define DDI_HIST_SUB (1 << DDI_HIST_SUB_BITS)
+#define DDI_HIST_MAX_BITS 30
+#define DDI_HIST_BUCKETS ((DDI_HIST_MAX_BITS - DDI_HIST_SUB_BITS + 1) * DDI_HIST_SUB)
+
+/* Pending bios summary: LBA regions and bios visited per delayed_bios_lock hold. */
+#define DDI_SUMMARY_REGIONS 16
+#define DDI_SUMMARY_BATCH 1024
+
+/* Default and maximum record ring data pages per CPU. */
+#define DDI_RECORD_DEFAULT_PAGES 16
+#define DDI_RECORD_MAX_PAGES 1024
+
+struct ddi_hist {
+	u64 buckets[DDI_HIST_BUCKETS];
+	u64 sum;
+};
+
+/*
+ * Per direction histograms of the delay decided in delay_map() and the time
+ * actually held. Completed bios also split their latency into the configured
+ * delay, extra queueing in ddi beyond it, and the backing device service time.
+ */
+struct latency_hists {
+	struct ddi_hist delay[2];
+	struct ddi_hist hold[2];
+	/* Recorded at completion, like queue and service, unlike delay. */
+	struct ddi_hist completed_delay[2];
+	struct ddi_hist queue[2];
+	struct ddi_hist service[2];
+	/* How late bios are released after their expiry, both directions. */
+	struct ddi_hist lateness;
+};
+
+/* Operation types and stages counted in struct io_stats. */
+enum ddi_op {
+	DDI_OP_READ,
+	DDI_OP_WRITE,
+	DDI_OP_FLUSH,
+	DDI_OP_DISCARD,
+	DDI_OP_WRITE_ZEROES,
+	DDI_NR_OPS
+};
+
+/*
+ * Every submitted bio is either delayed or passed through; delayed bios are
+ * counted again as dispatched once they are released from the queue.
+ */
+enum ddi_stat {
+	DDI_STAT_SUBMITTED,
+	DDI_STAT_DELAYED,
+	DDI_STAT_PASSTHROUGH,
+	DDI_STAT_DISPATCHED,
+	DDI_NR_STATS
+};
+
+struct io_stats {
+	u64 ops[DDI_NR_OPS][DDI_NR_STATS];
+	u64 bytes[DDI_NR_OPS][DDI_NR_STATS];
+};
+
+/* Code paths of ddi itself whose CPU time is accounted in struct cpu_cost. */
+enum ddi_cost {
+	DDI_COST_MAP,
+	DDI_COST_TIMER,
+	DDI_COST_WORK,
+	DDI_NR_COSTS
+};
+
+/* Bios are those mapped for DDI_COST_MAP and released for DDI_COST_WORK. */
+struct cpu_cost {
+	u64 calls[DDI_NR_COSTS];
+	u64 ns[DDI_NR_COSTS];
+	u64 bios[DDI_NR_COSTS];
+};
+
+/*
+ * Bios and bytes held in the delay queue for one direction, updated with
+ * atomics only. The time-weighted average depth is the area under the depth
+ * curve, which equals the time dispatched bios were held plus the time the
+ * queued ones have been held so far: held_us + depth * now - queued_us.
+ * Times are in microseconds since the target was created.
+ */
+struct queue_gauge {
+	atomic64_t depth;
+	atomic64_t bytes;
+	atomic64_t peak_depth;
+	atomic64_t peak_bytes;
+	atomic64_t held_us;
+	atomic64_t queued_us;
+	/* Area and time at the last reset. */
+	s64 area_base;
+	u64 reset_us;
+};
+
+/* What happens to bios already queued when read_delay or write_delay changes. */
+enum ddi_retime {
+	DDI_RETIME_KEEP,
+	DDI_RETIME_RECOMPUTE,
+	DDI_RETIME_RELEASE,
+	DDI_NR_RETIMES
+};
+
+/*
+ * Where the base part of a bio's delay came from. Only that part follows a
+ * change of the base delay, see retime_bios().
+ */
+enum ddi_base {
+	DDI_BASE_NONE,		/* replaced as a whole, e.g. by an ioprio_delay */
+	DDI_BASE_OWN,		/* read_delay/write_delay of the target */
+	DDI_BASE_GROUP,		/* read_delay/write_delay of its delay group */
+};
+
+/* Conditions of struct ddi_trigger. */
+enum ddi_trigger_type {
+	DDI_TRIGGER_NONE,
+	DDI_TRIGGER_BYTES_WRITTEN,	/* arg[0] bytes written since armed */
+	DDI_TRIGGER_FLUSH,		/* the arg[0]th flush since armed */
+	DDI_TRIGGER_SECTOR,		/* any access to arg[1] sectors from arg[0] */
+	DDI_TRIGGER_TIME,		/* arg[0] ms after the table was loaded */
+	DDI_TRIGGER_AT,			/* wall clock at_clocks[arg[0]] reaching arg[1] ns */
+	DDI_NR_TRIGGERS
+};
+
+/*
+ * Once the condition is met, bios get delay[dir] (-1 keeps the delay) as
+ * base delay from the triggering bio on, unless a delay group sets that
+ * direction. The profile is then written to read_delay/write_delay and the
+ * trigger disarmed by trigger_apply().
+ * Every arming gets a new seq, compared with delay_c.trigger_fired.
+ */
+struct ddi_trigger {
+	unsigned type;
+	u64 seq;
+	u64 arg[2];
+	int delay[2];
+};
+
+/* Base delays of a delay group, -1 where members use their own. */
+struct ddi_group_config {
+	struct rcu_head rcu;
+	int delay[2];
+};
+
+/*
+ * A delay group, /sys/fs/ddi/groups/<name>/. Every member takes its base
+ * delays from the one config, so a change applies to all of them at once.
+ * Groups are listed in ddi_groups; config changes are serialized by lock.
+ */
+struct ddi_group {
+	struct rcu_head rcu;
+	struct list_head node;
+	char name[32];
+	struct ddi_group_config __rcu *config;
+	struct mutex lock;
+	/* Number of targets joined, under ddi_groups_lock. */
+	unsigned members;
+
+	struct kobject *kobj;
+	struct attribute *attrs[4];
+	struct attribute_group attr_group;
+	struct kobj_attribute read_delay_attr;
+	struct kobj_attribute write_delay_attr;
+	struct kobj_attribute members_attr;
+};
+
+/*
+ * Tunables consulted when deciding delays. A config is never modified once
+ * published: writers copy it under config_lock, change the copy and swap it
+ * in, so delay_map() sees either all or none of a change under RCU.
+ */
+struct ddi_config {
+	struct rcu_head rcu;
+	/* Incremented by every published change. */
+	u64 generation;
+
+	unsigned read_delay;
+	unsigned write_delay;
+	/* enum ddi_retime */
+	unsigned delay_retime;
+
+	/* Per ioprio class and level delay overriding read_delay/write_delay. */
+	int ioprio_delay[DDI_IOPRIO_CLASSES][DDI_IOPRIO_LEVELS];
+
+	/* Bios per second released on thaw, 0 releases everything at once. */
+	unsigned thaw_rate;
+
+	/*
+	 * Garbage collection model: every gc_interval_mb MiB written, writes (and
+	 * reads if gc_stall_reads) stall for gc_pause +/- gc_jitter milliseconds.
+	 */
+	unsigned gc_interval_mb;
+	unsigned gc_pause;
+	unsigned gc_jitter;
+	unsigned gc_stall_reads;
+
+	/*
+	 * SLC write cache model: writes take slc_fast_delay ms while the cache
+	 * has room, then slc_slow_delay ms plus the time to write them at
+	 * slc_slow_bw KiB/s. The cache drains at slc_drain_rate MiB/s.
+	 */
+	unsigned slc_capacity_mb;
+	unsigned slc_fast_delay;
+	unsigned slc_slow_delay;
+	unsigned slc_slow_bw;
+	unsigned slc_drain_rate;
+
+	/* Delay of reads hitting the device read cache. */
+	unsigned rcache_hit_delay;
+
+	/*
+	 * On suspend, wait up to suspend_wait ms for queued bios to expire
+	 * before releasing the rest. If reload_keep, a table reloaded in place
+	 * of this target takes over its config and model state.
+	 */
+	unsigned suspend_wait;
+	unsigned reload_keep;
+
+	struct ddi_trigger trigger;
+	/* Added to the wall clock by "at" triggers, to fake a skewed host clock. */
+	s64 clock_offset;
+};
+
 struct delay_c {
 	struct timer_list delay_timer;
 	struct mutex timer_lock;
@@ -31,208 +322,2880 @@ struct delay_c {
 	struct list_head delayed_bios;
 	atomic_t may_delay;
 
+	/* The mapped device, for tracepoints. */
+	dev_t devt;
+	sector_t len;
+
+	/*
+	 * Position in ddi_targets, to find the target replaced on a reload.
+	 * index counts the ddi targets before this one in its table.
+	 */
+	struct list_head node;
+	struct mapped_device *md;
+	struct dm_table *table;
+	unsigned index;
+	/* "<DM device name>:<index>", naming the sysfs and debugfs directories. */
+	char name[DM_NAME_LEN + 11];
+	/* Set on the first resume, when a replaced target hands over to this one. */
+	bool resumed;
+
 	struct dm_dev *dev_read;
 	sector_t start_read;
-	unsigned read_delay;
-	unsigned reads;
 
 	struct dm_dev *dev_write;
 	sector_t start_write;
-	unsigned write_delay;
-	unsigned writes;
+
+	/*
+	 * Current tunables. A "set" message stages its changes in batch, which
+	 * sysfs store handlers called by batch_owner edit instead of copying.
+	 */
+	struct ddi_config __rcu *config;
+	struct mutex config_lock;
+	/* Delay group joined, if any; changed under ddi_groups_lock. */
+	struct ddi_group __rcu *group;
+	struct ddi_config *batch;
+	struct task_struct *batch_owner;
+
+	/* Per direction (READ/WRITE) occupancy of delayed_bios. */
+	struct queue_gauge queue[2];
+	u64 epoch;
+
+	/* Dispatch accuracy: timer and work activity and bios released per work run. */
+	atomic64_t timer_fires;
+	atomic64_t work_runs;
+	atomic64_t work_bios;
+	atomic64_t work_max_bios;
+
+	/* Per direction (READ/WRITE) freeze; held bios are released on thaw only. */
+	bool frozen[2];
+
+	/*
+	 * Trigger state: bytes or flushes counted since arming, seq of the
+	 * trigger that fired last and when, relative to epoch.
+	 */
+	atomic64_t trigger_count;
+	atomic64_t trigger_fired;
+	u64 trigger_fired_ns;
+	struct work_struct trigger_work;
+
+	/*
+	 * Timer of a "time" or "at" trigger, armed when the trigger is
+	 * published, and how late it went off, once it did. at_when is on
+	 * at_clock as the host sees it.
+	 */
+	struct hrtimer at_timer;
+	u64 at_seq;
+	clockid_t at_clock;
+	u64 at_when;
+	s64 at_late_ns;
+	bool at_done;
+
+	/*
+	 * One-shot delays per operation type: the next oneshot_left bios get
+	 * exactly oneshot_delay ms, whatever the tunables and models say.
+	 */
+	atomic_t oneshot_left[DDI_NR_OPS];
+	unsigned oneshot_delay[DDI_NR_OPS];
+
+	/* Garbage collection model state, see struct ddi_config. */
+	u64 __percpu *gc_pending;
+	atomic64_t gc_written;
+	atomic64_t gc_events;
+	unsigned long gc_until;
+
+	/* SLC write cache model state, see struct ddi_config. */
+	spinlock_t slc_lock;
+	u64 slc_fill;
+	u64 slc_updated;
+	u64 slc_busy_until;
+
+	/*
+	 * Device read cache: reads of extents recently read or written take
+	 * rcache_hit_delay ms instead of the regular delay. The tracker is
+	 * replaced under rcache_lock and looked up locklessly under RCU.
+	 */
+	struct rcache __rcu *rcache;
+	struct mutex rcache_lock;
+	unsigned rcache_extents;
+	unsigned rcache_extent_kb;
+	struct rcache_stats __percpu *rcache_stats;
+
+	struct latency_hists __percpu *latency;
+	struct io_stats __percpu *stats;
+
+	unsigned cost_accounting;
+	struct cpu_cost __percpu *cost;
+
+	/*
+	 * Record mode. The ring is replaced under record_lock and written
+	 * under RCU on completion.
+	 */
+	unsigned record;
+	unsigned record_pages;
+	struct ddi_ring __rcu *ring;
+	struct mutex record_lock;
+
+	struct dentry *debugfs_dir;
 
 	struct kobject *kobj;
+	struct attribute *attrs[42];
+	struct attribute_group attr_group;
 	struct kobj_attribute read_delay_attr;
 	struct kobj_attribute write_delay_attr;
+	struct kobj_attribute delay_retime_attr;
+	struct kobj_attribute drain_attr;
+	struct kobj_attribute suspend_wait_attr;
+	struct kobj_attribute reload_keep_attr;
+	struct kobj_attribute trigger_attr;
+	struct kobj_attribute oneshot_attr;
+	struct kobj_attribute group_attr;
+	struct kobj_attribute clock_offset_attr;
+	struct kobj_attribute ioprio_delay_attr;
+	struct kobj_attribute freeze_read_attr;
+	struct kobj_attribute freeze_write_attr;
+	struct kobj_attribute thaw_rate_attr;
+	struct kobj_attribute frozen_attr;
+	struct kobj_attribute gc_interval_mb_attr;
+	struct kobj_attribute gc_pause_attr;
+	struct kobj_attribute gc_jitter_attr;
+	struct kobj_attribute gc_stall_reads_attr;
+	struct kobj_attribute gc_events_attr;
+	struct kobj_attribute slc_capacity_mb_attr;
+	struct kobj_attribute slc_fast_delay_attr;
+	struct kobj_attribute slc_slow_delay_attr;
+	struct kobj_attribute slc_slow_bw_attr;
+	struct kobj_attribute slc_drain_rate_attr;
+	struct kobj_attribute slc_fill_attr;
+	struct kobj_attribute rcache_extents_attr;
+	struct kobj_attribute rcache_extent_kb_attr;
+	struct kobj_attribute rcache_hit_delay_attr;
+	struct kobj_attribute rcache_stats_attr;
+	struct kobj_attribute latency_histogram_attr;
+	struct kobj_attribute completion_histogram_attr;
+	struct kobj_attribute stats_attr;
+	struct kobj_attribute queue_attr;
+	struct kobj_attribute queue_reset_attr;
+	struct kobj_attribute dispatch_attr;
+	struct kobj_attribute record_attr;
+	struct kobj_attribute record_pages_attr;
+	struct kobj_attribute record_drops_attr;
+	struct kobj_attribute cost_accounting_attr;
+	struct kobj_attribute cpu_cost_attr;
 };
 
+/*
+ * Per-bio data, linked in delayed_bios while the bio is held. Readers of
+ * the debugfs pending view park a cursor in the list, an entry whose
+ * context is NULL; list walkers must skip those with is_cursor().
+ */
 struct dm_delay_info {
 	struct delay_c *context;
 	struct list_head list;
 	unsigned long expires;
+	unsigned delay;
+	enum ddi_base base;
+	u64 queued;
+	u64 expires_ns;
+	u64 dispatched;
+	/* The iterator is consumed by the time the bio completes. */
+	sector_t sector;
+	unsigned bytes;
+	pid_t pid;
 };
 
 static DEFINE_MUTEX(delayed_bios_lock);
 
-/* Sysfs implementation for dynamic parameter control.*/
-static struct kobject *ddi_kobj;
+/* Every constructed target, oldest first. */
+static LIST_HEAD(ddi_targets);
+static DEFINE_MUTEX(ddi_targets_lock);
 
-static ssize_t show_delay(unsigned delay, char *buf)
+static LIST_HEAD(ddi_groups);
+static DEFINE_MUTEX(ddi_groups_lock);
+
+static inline bool is_cursor(struct dm_delay_info *delayed)
 {
-	/* The buffer allocation size is PAGE_SIZE(=4k typically) so it is safe to print an int
-	 * without limiting length.
-	 * ref: https://www.kernel.org/doc/Documentation/filesystems/sysfs.txt
-	 */
-	return sprintf(buf, "%u\n", delay);
+	return !delayed->context;
 }
 
-static void queue_timeout(struct delay_c *dc, unsigned long expires);
+static inline unsigned bio_bytes(struct bio *bio)
+{
+	return bio_sectors(bio) << 9;
+}
 
-static ssize_t store_delay(struct delay_c *dc, unsigned *delay, const char *buf, size_t count)
+/* Cumulative I/O counters. */
+
+static const char *const ddi_op_names[DDI_NR_OPS] = {
+	"read", "write", "flush", "discard", "write_zeroes",
+};
+
+static enum ddi_op bio_ddi_op(struct bio *bio)
 {
-	unsigned new_delay;
-	unsigned long expires;
+	switch (bio_op(bio)) {
+	case REQ_OP_READ:
+		return DDI_OP_READ;
+	case REQ_OP_FLUSH:
+		return DDI_OP_FLUSH;
+	case REQ_OP_DISCARD:
+	case REQ_OP_SECURE_ERASE:
+		return DDI_OP_DISCARD;
+	case REQ_OP_WRITE_ZEROES:
+		return DDI_OP_WRITE_ZEROES;
+	default:
+		/* Bio based flushes are empty writes with REQ_PREFLUSH. */
+		if ((bio->bi_opf & REQ_PREFLUSH) && !bio_sectors(bio))
+			return DDI_OP_FLUSH;
+		return op_is_write(bio_op(bio)) ? DDI_OP_WRITE : DDI_OP_READ;
+	}
+}
 
-	/* buf is null-terminated. */
-	sscanf(buf, "%d", &new_delay);
-	if (new_delay < 0) {
-		printk(KERN_WARNING "Not setting an invalid delay: %d\n", new_delay);
-		return count;
+static void stats_account(struct io_stats __percpu *stats, enum ddi_op op,
+			  enum ddi_stat stat, unsigned bytes)
+{
+	this_cpu_inc(stats->ops[op][stat]);
+	this_cpu_add(stats->bytes[op][stat], bytes);
+}
+
+static void stats_sum(struct io_stats __percpu *stats, struct io_stats *out)
+{
+	int cpu, op, stat;
+
+	memset(out, 0, sizeof(*out));
+	for_each_possible_cpu(cpu) {
+		struct io_stats *s = per_cpu_ptr(stats, cpu);
+
+		for (op = 0; op < DDI_NR_OPS; op++) {
+			for (stat = 0; stat < DDI_NR_STATS; stat++) {
+				out->ops[op][stat] += READ_ONCE(s->ops[op][stat]);
+				out->bytes[op][stat] += READ_ONCE(s->bytes[op][stat]);
+			}
+		}
 	}
+}
 
-	printk(KERN_DEBUG "Updating delay %u => %u\n", *delay, new_delay);
-	*delay = new_delay;
-	smp_wmb();
+/* CPU cost of the injector. */
 
-	/* Update timer to cancel possibly existing too long timeout. */
-	expires = jiffies + msecs_to_jiffies(new_delay);
-	queue_timeout(dc, expires);
+static const char *const ddi_cost_names[DDI_NR_COSTS] = {
+	"map", "timer", "work",
+};
 
-	return count;
+/*
+ * Returns the start time, or 0 if accounting is off. Time the path sleeps,
+ * waiting for a lock or in the backend, is left out by moving the start
+ * forward, so the cost is the CPU time of ddi itself.
+ */
+static inline u64 cost_start(struct delay_c *dc)
+{
+	return READ_ONCE(dc->cost_accounting) ? ktime_get_ns() : 0;
 }
 
-static ssize_t read_delay_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+/* Takes @lock; waiting for it does not count towards the cost at @start. */
+static void cost_lock(struct mutex *lock, u64 *start)
 {
-	struct delay_c *dc = container_of(attr, struct delay_c, read_delay_attr);
-	return show_delay(dc->read_delay, buf);
+	u64 wait;
+
+	if (!start || !*start) {
+		mutex_lock(lock);
+		return;
+	}
+	if (mutex_trylock(lock))
+		return;
+	wait = ktime_get_ns();
+	mutex_lock(lock);
+	*start += ktime_get_ns() - wait;
 }
 
-static ssize_t read_delay_store(struct kobject *kobj, struct kobj_attribute *attr,
-								const char *buf, size_t count)
+static inline void cost_end(struct delay_c *dc, enum ddi_cost cost, u64 start, unsigned bios)
 {
-	struct delay_c *dc = container_of(attr, struct delay_c, read_delay_attr);
-	return store_delay(dc, &dc->read_delay, buf, count);
+	if (!start)
+		return;
+	this_cpu_inc(dc->cost->calls[cost]);
+	this_cpu_add(dc->cost->ns[cost], ktime_get_ns() - start);
+	this_cpu_add(dc->cost->bios[cost], bios);
 }
 
-static ssize_t write_delay_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+/* Queue occupancy gauges. */
+
+static u64 gauge_us(struct delay_c *dc, u64 ns)
 {
-	struct delay_c *dc = container_of(attr, struct delay_c, write_delay_attr);
-	return show_delay(dc->write_delay, buf);
+	return div_u64(ns - dc->epoch, NSEC_PER_USEC);
 }
 
-static ssize_t write_delay_store(struct kobject *kobj, struct kobj_attribute *attr,
-								 const char *buf, size_t count)
+static void gauge_peak(atomic64_t *peak, s64 val)
 {
-	struct delay_c *dc = container_of(attr, struct delay_c, write_delay_attr);
-	if (!dc->dev_write) {
-		printk(KERN_WARNING "Write device is not configured\n");
-		return count;
+	s64 old = atomic64_read(peak);
+
+	while (val > old) {
+		s64 prev = atomic64_cmpxchg(peak, old, val);
+
+		if (prev == old)
+			break;
+		old = prev;
 	}
-	return store_delay(dc, &dc->write_delay, buf, count);
 }
 
-static int init_dev_kobject(struct delay_c *dc)
+static void gauge_enqueue(struct delay_c *dc, int dir, struct dm_delay_info *delayed)
 {
-	int ret = 0;
-	static struct attribute *attrs[3];
-	static struct attribute_group attr_group = { .attrs = attrs };
-	attrs[0] = &dc->read_delay_attr.attr;
-	attrs[1] = &dc->write_delay_attr.attr;
-	attrs[2] = NULL;
+	struct queue_gauge *q = &dc->queue[dir];
 
-	dc->kobj = kobject_create_and_add(dc->dev_read->name, ddi_kobj);
-	if (!dc->kobj)
-		return -ENOMEM;
+	atomic64_add(gauge_us(dc, delayed->queued), &q->queued_us);
+	gauge_peak(&q->peak_bytes, atomic64_add_return(delayed->bytes, &q->bytes));
+	gauge_peak(&q->peak_depth, atomic64_inc_return(&q->depth));
+}
 
-	dc->read_delay_attr = (struct kobj_attribute)__ATTR(read_delay, 0644, read_delay_show, read_delay_store);
-	dc->write_delay_attr = (struct kobj_attribute)__ATTR(write_delay, 0644, write_delay_show, write_delay_store);
+static void gauge_dispatch(struct delay_c *dc, int dir, struct dm_delay_info *delayed)
+{
+	struct queue_gauge *q = &dc->queue[dir];
+	u64 queued_us = gauge_us(dc, delayed->queued);
 
-	ret = sysfs_create_group(dc->kobj, &attr_group);
-	if (ret)
-		kobject_put(dc->kobj);
+	atomic64_add(gauge_us(dc, delayed->dispatched) - queued_us, &q->held_us);
+	atomic64_sub(queued_us, &q->queued_us);
+	atomic64_sub(delayed->bytes, &q->bytes);
+	atomic64_dec(&q->depth);
+}
 
-	return ret;
+static s64 gauge_area(struct queue_gauge *q, u64 now_us)
+{
+	return atomic64_read(&q->held_us) + atomic64_read(&q->depth) * (s64)now_us -
+		atomic64_read(&q->queued_us);
 }
 
-static void destroy_dev_kobject(struct delay_c *dc)
+/* Time-weighted average depth since the last reset, in thousandths. */
+static u64 gauge_avg_milli(struct queue_gauge *q, u64 now_us)
 {
-	kobject_put(dc->kobj);
+	u64 elapsed = now_us - READ_ONCE(q->reset_us);
+	s64 area = gauge_area(q, now_us) - READ_ONCE(q->area_base);
+	u64 avg;
+
+	if (!elapsed || area <= 0)
+		return 0;
+	avg = div64_u64(area, elapsed);
+	return avg * 1000 + div64_u64((area - avg * elapsed) * 1000, elapsed);
 }
 
-/* Device Mapper implementation. */
+static void gauge_reset(struct delay_c *dc, int dir)
+{
+	struct queue_gauge *q = &dc->queue[dir];
+	u64 now_us = gauge_us(dc, ktime_get_ns());
+
+	atomic64_set(&q->peak_depth, atomic64_read(&q->depth));
+	atomic64_set(&q->peak_bytes, atomic64_read(&q->bytes));
+	WRITE_ONCE(q->area_base, gauge_area(q, now_us));
+	WRITE_ONCE(q->reset_us, now_us);
+}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-static void handle_delayed_timer(unsigned long data)
+static s64 queue_depth(struct delay_c *dc)
 {
-	struct delay_c *dc = (struct delay_c *)data;
-#else
-static void handle_delayed_timer(struct timer_list *t)
+	return atomic64_read(&dc->queue[READ].depth) + atomic64_read(&dc->queue[WRITE].depth);
+}
+
+/* Binary record rings. */
+
+static struct ddi_ring_header *ring_header(struct ddi_ring *ring, int cpu)
 {
-	struct delay_c *dc = from_timer(dc, t, delay_timer);
-#endif
+	return ring->buf + cpu * ring->stride;
+}
 
-	queue_work(dc->kdelayd_wq, &dc->flush_expired_bios);
+static struct ddi_ring *ring_alloc(unsigned pages)
+{
+	struct ddi_ring *ring;
+	int cpu;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+
+	ring->stride = DDI_RING_HEADER_SIZE + (size_t)pages * PAGE_SIZE;
+	ring->nr_records = pages * PAGE_SIZE / sizeof(struct ddi_record);
+	ring->buf = vmalloc_user(ring->stride * nr_cpu_ids);
+	if (!ring->buf) {
+		kfree(ring);
+		return NULL;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct ddi_ring_header *hdr = ring_header(ring, cpu);
+
+		hdr->nr_records = ring->nr_records;
+		hdr->record_size = sizeof(struct ddi_record);
+	}
+	return ring;
 }
 
-static void queue_timeout(struct delay_c *dc, unsigned long expires)
+static void ring_free(struct ddi_ring *ring)
 {
-	mutex_lock(&dc->timer_lock);
+	if (!ring)
+		return;
+	/* Pages still mapped by userspace stay alive until unmapped. */
+	vfree(ring->buf);
+	kfree(ring);
+}
 
-	if (!timer_pending(&dc->delay_timer) || expires < dc->delay_timer.expires)
-		mod_timer(&dc->delay_timer, expires);
+/*
+ * Append a record to this CPU's ring, or count a drop if userspace has not
+ * consumed enough. Interrupts are disabled since bios may complete in
+ * interrupt context, which must not interleave with a writer on this CPU.
+ */
+static void ring_write(struct ddi_ring *ring, const struct ddi_record *rec)
+{
+	struct ddi_ring_header *hdr;
+	struct ddi_record *slot;
+	unsigned long flags;
+	u64 head, tail;
+
+	local_irq_save(flags);
+	hdr = ring_header(ring, smp_processor_id());
+	head = hdr->head;
+	tail = smp_load_acquire(&hdr->tail);
+	if (head - tail >= ring->nr_records) {
+		WRITE_ONCE(hdr->drops, hdr->drops + 1);
+	} else {
+		slot = (void *)hdr + DDI_RING_HEADER_SIZE;
+		slot[head & (ring->nr_records - 1)] = *rec;
+		smp_store_release(&hdr->head, head + 1);
+	}
+	local_irq_restore(flags);
+}
+
+/* Latency histograms. */
+
+static unsigned hist_index(u64 us)
+{
+	unsigned shift;
+
+	if (us >= 1ULL << DDI_HIST_MAX_BITS)
+		return DDI_HIST_BUCKETS - 1;
+	if (us < 2 * DDI_HIST_SUB)
+		return us;
+
+	shift = fls64(us) - 1 - DDI_HIST_SUB_BITS;
+	return shift * DDI_HIST_SUB + (us >> shift);
+}
+
+/* Lowest and highest values counted in a bucket. */
+static u64 hist_lower(unsigned index)
+{
+	if (index < 2 * DDI_HIST_SUB)
+		return index;
+	return (u64)(index % DDI_HIST_SUB + DDI_HIST_SUB) << (index / DDI_HIST_SUB - 1);
+}
+
+static u64 hist_upper(unsigned index)
+{
+	if (index < 2 * DDI_HIST_SUB)
+		return index;
+	return ((u64)(index % DDI_HIST_SUB + DDI_HIST_SUB + 1) << (index / DDI_HIST_SUB - 1)) - 1;
+}
+
+/* Lock-free: each CPU only ever updates its own copy. */
+static void hist_record(struct ddi_hist __percpu *hist, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	this_cpu_inc(hist->buckets[hist_index(us)]);
+	this_cpu_add(hist->sum, us);
+}
+
+static void hist_merge(struct ddi_hist __percpu *hist, struct ddi_hist *out)
+{
+	int cpu, i;
+
+	memset(out, 0, sizeof(*out));
+	for_each_possible_cpu(cpu) {
+		struct ddi_hist *h = per_cpu_ptr(hist, cpu);
+
+		for (i = 0; i < DDI_HIST_BUCKETS; i++)
+			out->buckets[i] += READ_ONCE(h->buckets[i]);
+		out->sum += READ_ONCE(h->sum);
+	}
+}
+
+static void hist_reset(struct ddi_hist __percpu *hist)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(hist, cpu), 0, sizeof(struct ddi_hist));
+}
+
+/* Highest value of the bucket holding the @permille-th permille of samples. */
+static u64 hist_percentile(struct ddi_hist *h, u64 count, unsigned permille)
+{
+	u64 target = DIV_ROUND_UP_ULL(count * permille, 1000);
+	u64 seen = 0;
+	int i;
+
+	for (i = 0; i < DDI_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen && seen >= target)
+			return hist_upper(i);
+	}
+	return 0;
+}
+
+/*
+ * Print a summary line and the non-empty buckets as "<lowest us>:<count>".
+ * Output is truncated at PAGE_SIZE.
+ */
+static ssize_t hist_print(char *buf, ssize_t len, const char *name,
+			  struct ddi_hist __percpu *hist, struct ddi_hist *tmp)
+{
+	u64 count = 0;
+	int i;
+
+	hist_merge(hist, tmp);
+	for (i = 0; i < DDI_HIST_BUCKETS; i++)
+		count += tmp->buckets[i];
+
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			 "%s count %llu mean_us %llu p50_us %llu p99_us %llu p999_us %llu sum_us %llu\n",
+			 name, (unsigned long long)count,
+			 (unsigned long long)(count ? div64_u64(tmp->sum, count) : 0),
+			 (unsigned long long)hist_percentile(tmp, count, 500),
+			 (unsigned long long)hist_percentile(tmp, count, 990),
+			 (unsigned long long)hist_percentile(tmp, count, 999),
+			 (unsigned long long)tmp->sum);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "%s buckets", name);
+	for (i = 0; i < DDI_HIST_BUCKETS; i++)
+		if (tmp->buckets[i])
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %llu:%llu",
+					 (unsigned long long)hist_lower(i),
+					 (unsigned long long)tmp->buckets[i]);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+/* Sysfs implementation for dynamic parameter control.*/
+static struct kobject *ddi_kobj;
+static struct kobject *groups_kobj;
+static struct dentry *ddi_debugfs;
+
+/* Configuration snapshots. */
+
+/* Reads one field of the current config. */
+#define config_read(dc, _field)						\
+({									\
+	typeof(((struct ddi_config *)0)->_field) __val;			\
+	rcu_read_lock();						\
+	__val = rcu_dereference((dc)->config)->_field;			\
+	rcu_read_unlock();						\
+	__val;								\
+})
+
+/* Wall-clock "at" triggers. */
+
+static const char *const at_clock_names[] = { "realtime", "tai" };
+static const clockid_t at_clocks[] = { CLOCK_REALTIME, CLOCK_TAI };
+
+static u64 at_clock_ns(clockid_t clock)
+{
+	switch (clock) {
+	case CLOCK_REALTIME:
+		return ktime_get_real_ns();
+	case CLOCK_TAI:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,3,0)
+		return ktime_get_tai_ns();
+#else
+		return ktime_get_clocktai_ns();
+#endif
+	}
+	return ktime_get_ns();
+}
+
+/* Parses "<sec>[.<fraction>]" into nanoseconds. */
+static int parse_wall_time(const char *str, u64 *ns)
+{
+	char sec[21], frac[10] = "000000000";
+	const char *dot = strchr(str, '.');
+	size_t len = dot ? dot - str : strlen(str);
+	u64 s;
+	u32 f;
+
+	if (!len || len >= sizeof(sec))
+		return -EINVAL;
+	memcpy(sec, str, len);
+	sec[len] = '\0';
+	if (dot) {
+		len = strlen(dot + 1);
+		if (!len || len > 9)
+			return -EINVAL;
+		memcpy(frac, dot + 1, len);
+	}
+	if (kstrtoull(sec, 10, &s) || kstrtou32(frac, 10, &f) || s > U64_MAX / NSEC_PER_SEC - 1)
+		return -EINVAL;
+	*ns = s * NSEC_PER_SEC + f;
+	return 0;
+}
+
+/* Marks the trigger armed as @seq fired, unless it already did. */
+static void trigger_fire(struct delay_c *dc, u64 seq)
+{
+	s64 fired = atomic64_read(&dc->trigger_fired);
+
+	if (fired != seq && atomic64_cmpxchg(&dc->trigger_fired, fired, seq) == fired) {
+		WRITE_ONCE(dc->trigger_fired_ns, ktime_get_ns() - dc->epoch);
+		queue_work(dc->kdelayd_wq, &dc->trigger_work);
+	}
+}
+
+static enum hrtimer_restart at_timer_fn(struct hrtimer *timer)
+{
+	struct delay_c *dc = container_of(timer, struct delay_c, at_timer);
+
+	WRITE_ONCE(dc->at_late_ns, at_clock_ns(dc->at_clock) - dc->at_when);
+	WRITE_ONCE(dc->at_done, true);
+	trigger_fire(dc, dc->at_seq);
+	return HRTIMER_NORESTART;
+}
+
+static void at_timer_init(struct delay_c *dc, clockid_t clock)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+	hrtimer_init(&dc->at_timer, clock, HRTIMER_MODE_ABS);
+	dc->at_timer.function = at_timer_fn;
+#else
+	hrtimer_setup(&dc->at_timer, at_timer_fn, clock, HRTIMER_MODE_ABS);
+#endif
+}
+
+/*
+ * Arms the timer for the "time" or "at" trigger of @cfg, just published, or
+ * stops it if there is none, so that delays switch on time on an idle device
+ * too. For "at", an absolute hrtimer on the wall clock itself keeps the
+ * instant across clock steps. Called with config_lock held.
+ */
+static void at_arm(struct delay_c *dc, struct ddi_config *cfg)
+{
+	struct ddi_trigger *t = &cfg->trigger;
+
+	hrtimer_cancel(&dc->at_timer);
+	WRITE_ONCE(dc->at_done, false);
+	if (t->type == DDI_TRIGGER_AT) {
+		dc->at_clock = at_clocks[t->arg[0]];
+		dc->at_when = t->arg[1] - cfg->clock_offset;
+	} else if (t->type == DDI_TRIGGER_TIME) {
+		dc->at_clock = CLOCK_MONOTONIC;
+		dc->at_when = dc->epoch + t->arg[0] * NSEC_PER_MSEC;
+	} else {
+		return;
+	}
+
+	dc->at_seq = t->seq;
+	at_timer_init(dc, dc->at_clock);
+	hrtimer_start(&dc->at_timer, ns_to_ktime(dc->at_when), HRTIMER_MODE_ABS);
+}
+
+static void config_publish(struct delay_c *dc, struct ddi_config *new)
+{
+	struct ddi_config *old;
+
+	old = rcu_dereference_protected(dc->config, lockdep_is_held(&dc->config_lock));
+	new->generation = old->generation + 1;
+	rcu_assign_pointer(dc->config, new);
+	if (new->trigger.seq != old->trigger.seq || new->clock_offset != old->clock_offset)
+		at_arm(dc, new);
+	kfree_rcu(old, rcu);
+}
+
+/*
+ * Returns a private copy of the config to modify and pass to config_commit(),
+ * or the staged batch if called on behalf of a "set" message.
+ */
+static struct ddi_config *config_edit(struct delay_c *dc)
+{
+	struct ddi_config *new;
+
+	if (READ_ONCE(dc->batch_owner) == current)
+		return dc->batch;
+
+	mutex_lock(&dc->config_lock);
+	new = kmemdup(rcu_dereference_protected(dc->config, lockdep_is_held(&dc->config_lock)),
+		      sizeof(*new), GFP_KERNEL);
+	if (!new)
+		mutex_unlock(&dc->config_lock);
+	return new;
+}
+
+static void config_commit(struct delay_c *dc, struct ddi_config *new)
+{
+	if (READ_ONCE(dc->batch_owner) == current)
+		return;
+
+	config_publish(dc, new);
+	mutex_unlock(&dc->config_lock);
+}
+
+/* Drops a copy from config_edit() unchanged. */
+static void config_abort(struct delay_c *dc, struct ddi_config *new)
+{
+	if (READ_ONCE(dc->batch_owner) == current)
+		return;
+
+	kfree(new);
+	mutex_unlock(&dc->config_lock);
+}
+
+/* Stage every config change of the caller until config_batch_end(). */
+static int config_batch_begin(struct delay_c *dc)
+{
+	mutex_lock(&dc->config_lock);
+	dc->batch = kmemdup(rcu_dereference_protected(dc->config, lockdep_is_held(&dc->config_lock)),
+			    sizeof(*dc->batch), GFP_KERNEL);
+	if (!dc->batch) {
+		mutex_unlock(&dc->config_lock);
+		return -ENOMEM;
+	}
+	WRITE_ONCE(dc->batch_owner, current);
+	return 0;
+}
+
+static void delay_changed(struct delay_c *dc, int dir, unsigned old_delay,
+			  unsigned new_delay, enum ddi_retime policy);
+
+/*
+ * Publishes the staged changes at once, or drops them unless @apply. Queued
+ * bios follow changed delays only once they are published.
+ */
+static void config_batch_end(struct delay_c *dc, bool apply)
+{
+	struct ddi_config *old = rcu_dereference_protected(dc->config,
+							   lockdep_is_held(&dc->config_lock));
+	unsigned old_delay[2] = { old->read_delay, old->write_delay };
+	unsigned new_delay[2] = { dc->batch->read_delay, dc->batch->write_delay };
+	enum ddi_retime policy = dc->batch->delay_retime;
+	int dir;
+
+	WRITE_ONCE(dc->batch_owner, NULL);
+	if (apply)
+		config_publish(dc, dc->batch);
+	else
+		kfree(dc->batch);
+	dc->batch = NULL;
+	mutex_unlock(&dc->config_lock);
+
+	if (!apply)
+		return;
+	for (dir = READ; dir <= WRITE; dir++)
+		if (new_delay[dir] != old_delay[dir])
+			delay_changed(dc, dir, old_delay[dir], new_delay[dir], policy);
+}
+
+/* Defines show/store handlers for a plain unsigned tunable of struct delay_c. */
+#define DDI_UINT_ATTR(_name)							\
+static ssize_t _name##_show(struct kobject *kobj, struct kobj_attribute *attr,	\
+			    char *buf)						\
+{										\
+	struct delay_c *dc = container_of(attr, struct delay_c, _name##_attr);	\
+	return sprintf(buf, "%u\n", READ_ONCE(dc->_name));			\
+}										\
+static ssize_t _name##_store(struct kobject *kobj, struct kobj_attribute *attr,	\
+			     const char *buf, size_t count)			\
+{										\
+	struct delay_c *dc = container_of(attr, struct delay_c, _name##_attr);	\
+	unsigned val;								\
+	if (kstrtouint(buf, 10, &val))						\
+		return -EINVAL;							\
+	WRITE_ONCE(dc->_name, val);						\
+	return count;								\
+}
+
+/* Defines show/store handlers for a plain unsigned tunable of struct ddi_config. */
+#define DDI_CONFIG_ATTR(_name)							\
+static ssize_t _name##_show(struct kobject *kobj, struct kobj_attribute *attr,	\
+			    char *buf)						\
+{										\
+	struct delay_c *dc = container_of(attr, struct delay_c, _name##_attr);	\
+	return sprintf(buf, "%u\n", config_read(dc, _name));			\
+}										\
+static ssize_t _name##_store(struct kobject *kobj, struct kobj_attribute *attr,	\
+			     const char *buf, size_t count)			\
+{										\
+	struct delay_c *dc = container_of(attr, struct delay_c, _name##_attr);	\
+	struct ddi_config *cfg;							\
+	unsigned val;								\
+	if (kstrtouint(buf, 10, &val))						\
+		return -EINVAL;							\
+	cfg = config_edit(dc);							\
+	if (!cfg)								\
+		return -ENOMEM;							\
+	cfg->_name = val;							\
+	config_commit(dc, cfg);							\
+	return count;								\
+}
+
+static ssize_t show_delay(unsigned delay, char *buf)
+{
+	/* The buffer allocation size is PAGE_SIZE(=4k typically) so it is safe to print an int
+	 * without limiting length.
+	 * ref: https://www.kernel.org/doc/Documentation/filesystems/sysfs.txt
+	 */
+	return sprintf(buf, "%u\n", delay);
+}
+
+static void queue_timeout(struct delay_c *dc, unsigned long expires);
+static void freeze_bios(struct delay_c *dc, int dir);
+static u64 slc_current_fill(struct delay_c *dc);
+static int rcache_rebuild(struct delay_c *dc, unsigned extents, unsigned extent_kb);
+static int ring_setup(struct delay_c *dc, unsigned pages);
+static void thaw_bios(struct delay_c *dc, int dir);
+static void retime_bios(struct delay_c *dc, int dir, enum ddi_base from, enum ddi_base to,
+			unsigned old_delay, unsigned new_delay, enum ddi_retime policy);
+static void drain_bios(struct delay_c *dc, unsigned window_ms);
+static void trigger_apply(struct work_struct *work);
+
+/* Whether the group of @dc sets the @dir base delay instead of @dc itself. */
+static bool group_controls(struct delay_c *dc, int dir)
+{
+	struct ddi_group *grp;
+	bool grouped;
+
+	rcu_read_lock();
+	grp = rcu_dereference(dc->group);
+	grouped = grp && rcu_dereference(grp->config)->delay[dir] >= 0;
+	rcu_read_unlock();
+
+	return grouped;
+}
+
+/* Applies a change of the @dir base delay of @dc to its queued bios and timer. */
+static void delay_changed(struct delay_c *dc, int dir, unsigned old_delay,
+			  unsigned new_delay, enum ddi_retime policy)
+{
+	/* Bios of a direction the group decides on follow the group's delay. */
+	if (group_controls(dc, dir))
+		return;
+
+	if (policy != DDI_RETIME_KEEP && new_delay != old_delay)
+		retime_bios(dc, dir, DDI_BASE_OWN, DDI_BASE_OWN, old_delay, new_delay, policy);
+
+	/* Update timer to cancel possibly existing too long timeout. */
+	queue_timeout(dc, jiffies + msecs_to_jiffies(new_delay));
+}
+
+static ssize_t store_delay(struct delay_c *dc, int dir, const char *buf, size_t count)
+{
+	struct ddi_config *cfg;
+	unsigned new_delay, old_delay, *delay;
+	enum ddi_retime policy;
+
+	/* A bad value must fail so that a "set" message is rolled back. */
+	if (kstrtouint(buf, 10, &new_delay))
+		return -EINVAL;
+
+	cfg = config_edit(dc);
+	if (!cfg)
+		return -ENOMEM;
+	delay = dir == WRITE ? &cfg->write_delay : &cfg->read_delay;
+	old_delay = *delay;
+	*delay = new_delay;
+	policy = cfg->delay_retime;
+	config_commit(dc, cfg);
+
+	/* Within a "set" message, config_batch_end() does this once published. */
+	if (READ_ONCE(dc->batch_owner) != current)
+		delay_changed(dc, dir, old_delay, new_delay, policy);
+
+	return count;
+}
+
+static const char *const retime_names[DDI_NR_RETIMES] = {
+	"keep", "recompute", "release",
+};
+
+static ssize_t delay_retime_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, delay_retime_attr);
+	return sprintf(buf, "%s\n", retime_names[config_read(dc, delay_retime)]);
+}
+
+static ssize_t delay_retime_store(struct kobject *kobj, struct kobj_attribute *attr,
+								  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, delay_retime_attr);
+	struct ddi_config *cfg;
+	int policy;
+
+	for (policy = 0; policy < DDI_NR_RETIMES; policy++)
+		if (sysfs_streq(buf, retime_names[policy]))
+			break;
+	if (policy == DDI_NR_RETIMES)
+		return -EINVAL;
+
+	cfg = config_edit(dc);
+	if (!cfg)
+		return -ENOMEM;
+	cfg->delay_retime = policy;
+	config_commit(dc, cfg);
+	return count;
+}
+
+static ssize_t read_delay_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, read_delay_attr);
+	return show_delay(config_read(dc, read_delay), buf);
+}
+
+static ssize_t read_delay_store(struct kobject *kobj, struct kobj_attribute *attr,
+								const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, read_delay_attr);
+	return store_delay(dc, READ, buf, count);
+}
+
+static ssize_t write_delay_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, write_delay_attr);
+	return show_delay(config_read(dc, write_delay), buf);
+}
+
+static ssize_t write_delay_store(struct kobject *kobj, struct kobj_attribute *attr,
+								 const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, write_delay_attr);
+	if (!dc->dev_write) {
+		printk(KERN_WARNING "Write device is not configured\n");
+		return count;
+	}
+	return store_delay(dc, WRITE, buf, count);
+}
+
+static const char *const ioprio_class_names[DDI_IOPRIO_CLASSES] = {
+	"none", "rt", "be", "idle",
+};
+
+static ssize_t ioprio_delay_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, ioprio_delay_attr);
+	struct ddi_config *cfg;
+	ssize_t len = 0;
+	int class, level, delay;
+
+	/* One line per class, one column per level. "-" means not overridden. */
+	rcu_read_lock();
+	cfg = rcu_dereference(dc->config);
+	for (class = 0; class < DDI_IOPRIO_CLASSES; class++) {
+		len += sprintf(buf + len, "%s", ioprio_class_names[class]);
+		for (level = 0; level < DDI_IOPRIO_LEVELS; level++) {
+			delay = cfg->ioprio_delay[class][level];
+			if (delay == DDI_IOPRIO_INHERIT)
+				len += sprintf(buf + len, " -");
+			else
+				len += sprintf(buf + len, " %d", delay);
+		}
+		len += sprintf(buf + len, "\n");
+	}
+	rcu_read_unlock();
+	return len;
+}
+
+static int parse_ioprio_delay(const char *str, int *delay)
+{
+	unsigned val;
+
+	if (!strcmp(str, "-")) {
+		*delay = DDI_IOPRIO_INHERIT;
+		return 0;
+	}
+	if (kstrtouint(str, 10, &val) || val > INT_MAX)
+		return -EINVAL;
+	*delay = val;
+	return 0;
+}
+
+/*
+ * Accepts "<class> <delay>" to set every level of a class, or
+ * "<class> <level> <delay>" to set a single level. <delay> is in milliseconds,
+ * or "-" to fall back to read_delay/write_delay.
+ */
+static ssize_t ioprio_delay_store(struct kobject *kobj, struct kobj_attribute *attr,
+								  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, ioprio_delay_attr);
+	struct ddi_config *cfg;
+	char name[8], arg1[16], arg2[16];
+	int class, level, delay, nargs;
+	unsigned lv;
+
+	nargs = sscanf(buf, "%7s %15s %15s", name, arg1, arg2);
+	if (nargs < 2)
+		return -EINVAL;
+
+	for (class = 0; class < DDI_IOPRIO_CLASSES; class++)
+		if (!strcmp(name, ioprio_class_names[class]))
+			break;
+	if (class == DDI_IOPRIO_CLASSES)
+		return -EINVAL;
+
+	if (nargs == 2) {
+		if (parse_ioprio_delay(arg1, &delay))
+			return -EINVAL;
+		cfg = config_edit(dc);
+		if (!cfg)
+			return -ENOMEM;
+		for (level = 0; level < DDI_IOPRIO_LEVELS; level++)
+			cfg->ioprio_delay[class][level] = delay;
+		config_commit(dc, cfg);
+		return count;
+	}
+
+	if (kstrtouint(arg1, 10, &lv) || lv >= DDI_IOPRIO_LEVELS)
+		return -EINVAL;
+	if (parse_ioprio_delay(arg2, &delay))
+		return -EINVAL;
+	cfg = config_edit(dc);
+	if (!cfg)
+		return -ENOMEM;
+	cfg->ioprio_delay[class][lv] = delay;
+	config_commit(dc, cfg);
+
+	return count;
+}
+
+static ssize_t show_freeze(struct delay_c *dc, int dir, char *buf)
+{
+	return sprintf(buf, "%d\n", READ_ONCE(dc->frozen[dir]));
+}
+
+static ssize_t store_freeze(struct delay_c *dc, int dir, const char *buf, size_t count)
+{
+	bool freeze;
+
+	if (kstrtobool(buf, &freeze))
+		return -EINVAL;
+
+	if (freeze)
+		freeze_bios(dc, dir);
+	else
+		thaw_bios(dc, dir);
+
+	return count;
+}
+
+static ssize_t freeze_read_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, freeze_read_attr);
+	return show_freeze(dc, READ, buf);
+}
+
+static ssize_t freeze_read_store(struct kobject *kobj, struct kobj_attribute *attr,
+								 const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, freeze_read_attr);
+	return store_freeze(dc, READ, buf, count);
+}
+
+static ssize_t freeze_write_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, freeze_write_attr);
+	return show_freeze(dc, WRITE, buf);
+}
+
+static ssize_t freeze_write_store(struct kobject *kobj, struct kobj_attribute *attr,
+								  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, freeze_write_attr);
+	return store_freeze(dc, WRITE, buf, count);
+}
+
+DDI_CONFIG_ATTR(thaw_rate)
+
+static ssize_t frozen_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, frozen_attr);
+	s64 held[2][2] = { };
+	int dir;
+
+	/* Bios held per direction while it is frozen: "<dir> <bios> <bytes>". */
+	for (dir = READ; dir <= WRITE; dir++) {
+		if (!READ_ONCE(dc->frozen[dir]))
+			continue;
+		held[dir][0] = atomic64_read(&dc->queue[dir].depth);
+		held[dir][1] = atomic64_read(&dc->queue[dir].bytes);
+	}
+
+	return sprintf(buf, "read %lld %lld\nwrite %lld %lld\n",
+				   held[READ][0], held[READ][1], held[WRITE][0], held[WRITE][1]);
+}
+
+DDI_CONFIG_ATTR(gc_interval_mb)
+DDI_CONFIG_ATTR(gc_pause)
+DDI_CONFIG_ATTR(gc_jitter)
+DDI_CONFIG_ATTR(gc_stall_reads)
+
+static ssize_t gc_events_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, gc_events_attr);
+	return sprintf(buf, "%llu\n", (unsigned long long)atomic64_read(&dc->gc_events));
+}
+
+DDI_CONFIG_ATTR(slc_capacity_mb)
+DDI_CONFIG_ATTR(slc_fast_delay)
+DDI_CONFIG_ATTR(slc_slow_delay)
+DDI_CONFIG_ATTR(slc_slow_bw)
+DDI_CONFIG_ATTR(slc_drain_rate)
+
+static ssize_t slc_fill_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, slc_fill_attr);
+	return sprintf(buf, "%llu\n", (unsigned long long)slc_current_fill(dc));
+}
+
+static ssize_t rcache_extents_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, rcache_extents_attr);
+	return sprintf(buf, "%u\n", READ_ONCE(dc->rcache_extents));
+}
+
+static ssize_t rcache_extents_store(struct kobject *kobj, struct kobj_attribute *attr,
+									const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, rcache_extents_attr);
+	unsigned extents;
+	int ret;
+
+	if (kstrtouint(buf, 10, &extents) || extents > DDI_RCACHE_MAX_EXTENTS)
+		return -EINVAL;
+
+	mutex_lock(&dc->rcache_lock);
+	ret = rcache_rebuild(dc, extents, dc->rcache_extent_kb);
+	mutex_unlock(&dc->rcache_lock);
+
+	return ret ? ret : count;
+}
+
+static ssize_t rcache_extent_kb_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, rcache_extent_kb_attr);
+	return sprintf(buf, "%u\n", READ_ONCE(dc->rcache_extent_kb));
+}
+
+static ssize_t rcache_extent_kb_store(struct kobject *kobj, struct kobj_attribute *attr,
+									  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, rcache_extent_kb_attr);
+	unsigned extent_kb;
+	int ret;
+
+	if (kstrtouint(buf, 10, &extent_kb) || !is_power_of_2(extent_kb))
+		return -EINVAL;
+
+	mutex_lock(&dc->rcache_lock);
+	ret = rcache_rebuild(dc, dc->rcache_extents, extent_kb);
+	mutex_unlock(&dc->rcache_lock);
+
+	return ret ? ret : count;
+}
+
+DDI_CONFIG_ATTR(rcache_hit_delay)
+DDI_CONFIG_ATTR(suspend_wait)
+DDI_CONFIG_ATTR(reload_keep)
+
+static ssize_t rcache_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, rcache_stats_attr);
+	u64 hits = 0, misses = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct rcache_stats *stats = per_cpu_ptr(dc->rcache_stats, cpu);
+
+		hits += READ_ONCE(stats->hits);
+		misses += READ_ONCE(stats->misses);
+	}
+	return sprintf(buf, "%llu %llu\n", (unsigned long long)hits,
+				   (unsigned long long)misses);
+}
+
+static ssize_t latency_histogram_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, latency_histogram_attr);
+	struct ddi_hist *tmp;
+	ssize_t len = 0;
+
+	tmp = kmalloc(sizeof(*tmp), GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	len = hist_print(buf, len, "read delay", &dc->latency->delay[READ], tmp);
+	len = hist_print(buf, len, "read hold", &dc->latency->hold[READ], tmp);
+	len = hist_print(buf, len, "write delay", &dc->latency->delay[WRITE], tmp);
+	len = hist_print(buf, len, "write hold", &dc->latency->hold[WRITE], tmp);
+
+	kfree(tmp);
+	return len;
+}
+
+/* Any write clears the histograms. */
+static ssize_t latency_histogram_store(struct kobject *kobj, struct kobj_attribute *attr,
+									   const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, latency_histogram_attr);
+	int dir;
+
+	for (dir = READ; dir <= WRITE; dir++) {
+		hist_reset(&dc->latency->delay[dir]);
+		hist_reset(&dc->latency->hold[dir]);
+	}
+	return count;
+}
+
+static ssize_t completion_histogram_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, completion_histogram_attr);
+	struct ddi_hist *tmp;
+	ssize_t len = 0;
+
+	tmp = kmalloc(sizeof(*tmp), GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	len = hist_print(buf, len, "read queue", &dc->latency->queue[READ], tmp);
+	len = hist_print(buf, len, "read delay", &dc->latency->completed_delay[READ], tmp);
+	len = hist_print(buf, len, "read service", &dc->latency->service[READ], tmp);
+	len = hist_print(buf, len, "write queue", &dc->latency->queue[WRITE], tmp);
+	len = hist_print(buf, len, "write delay", &dc->latency->completed_delay[WRITE], tmp);
+	len = hist_print(buf, len, "write service", &dc->latency->service[WRITE], tmp);
+
+	kfree(tmp);
+	return len;
+}
+
+/* Any write clears the histograms. */
+static ssize_t completion_histogram_store(struct kobject *kobj, struct kobj_attribute *attr,
+										  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, completion_histogram_attr);
+	int dir;
+
+	for (dir = READ; dir <= WRITE; dir++) {
+		hist_reset(&dc->latency->queue[dir]);
+		hist_reset(&dc->latency->completed_delay[dir]);
+		hist_reset(&dc->latency->service[dir]);
+	}
+	return count;
+}
+
+/*
+ * One line per operation type: ops and bytes submitted, delayed, passed
+ * through and dispatched, in this order.
+ */
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, stats_attr);
+	struct io_stats sum;
+	ssize_t len = 0;
+	int op, stat;
+
+	stats_sum(dc->stats, &sum);
+	for (op = 0; op < DDI_NR_OPS; op++) {
+		len += sprintf(buf + len, "%s", ddi_op_names[op]);
+		for (stat = 0; stat < DDI_NR_STATS; stat++)
+			len += sprintf(buf + len, " %llu %llu",
+				       (unsigned long long)sum.ops[op][stat],
+				       (unsigned long long)sum.bytes[op][stat]);
+		len += sprintf(buf + len, "\n");
+	}
+
+	return len;
+}
+
+/*
+ * One line per direction: bios and bytes queued now, their peaks and the
+ * time-weighted average depth since the last reset.
+ */
+static ssize_t queue_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, queue_attr);
+	u64 now_us = gauge_us(dc, ktime_get_ns());
+	ssize_t len = 0;
+	int dir;
+
+	for (dir = READ; dir <= WRITE; dir++) {
+		struct queue_gauge *q = &dc->queue[dir];
+		u64 avg = gauge_avg_milli(q, now_us);
+
+		len += sprintf(buf + len, "%s %lld %lld %lld %lld %llu.%03llu\n",
+			       dir == WRITE ? "write" : "read",
+			       atomic64_read(&q->depth), atomic64_read(&q->bytes),
+			       atomic64_read(&q->peak_depth), atomic64_read(&q->peak_bytes),
+			       (unsigned long long)div_u64(avg, 1000),
+			       (unsigned long long)(avg % 1000));
+	}
+	return len;
+}
+
+/* Any write restarts the peaks and the average from now. */
+static ssize_t queue_reset_store(struct kobject *kobj, struct kobj_attribute *attr,
+								 const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, queue_reset_attr);
+
+	gauge_reset(dc, READ);
+	gauge_reset(dc, WRITE);
+	return count;
+}
+
+static ssize_t dispatch_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, dispatch_attr);
+	struct ddi_hist *tmp;
+	ssize_t len;
+
+	tmp = kmalloc(sizeof(*tmp), GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	len = sprintf(buf, "timer_fires %lld\nwork_runs %lld\nwork_bios %lld\nwork_max_bios %lld\n",
+		      atomic64_read(&dc->timer_fires), atomic64_read(&dc->work_runs),
+		      atomic64_read(&dc->work_bios), atomic64_read(&dc->work_max_bios));
+	len = hist_print(buf, len, "lateness", &dc->latency->lateness, tmp);
+
+	kfree(tmp);
+	return len;
+}
+
+/* Any write clears the counters and the lateness histogram. */
+static ssize_t dispatch_store(struct kobject *kobj, struct kobj_attribute *attr,
+							  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, dispatch_attr);
+
+	atomic64_set(&dc->timer_fires, 0);
+	atomic64_set(&dc->work_runs, 0);
+	atomic64_set(&dc->work_bios, 0);
+	atomic64_set(&dc->work_max_bios, 0);
+	hist_reset(&dc->latency->lateness);
+	return count;
+}
+
+DDI_UINT_ATTR(cost_accounting)
+
+static u64 div_or_zero(u64 n, u64 d)
+{
+	return d ? div64_u64(n, d) : 0;
+}
+
+/*
+ * One line per code path with calls, total ns and ns per call and per bio.
+ * The timer does not release bios itself, so its per bio cost is taken over
+ * the bios released by the work it queued. The total line is the cost of all
+ * paths per mapped bio.
+ */
+static ssize_t cpu_cost_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, cpu_cost_attr);
+	struct cpu_cost sum = { };
+	u64 bios, total = 0;
+	ssize_t len = 0;
+	int cpu, cost;
+
+	for_each_possible_cpu(cpu) {
+		struct cpu_cost *c = per_cpu_ptr(dc->cost, cpu);
+
+		for (cost = 0; cost < DDI_NR_COSTS; cost++) {
+			sum.calls[cost] += READ_ONCE(c->calls[cost]);
+			sum.ns[cost] += READ_ONCE(c->ns[cost]);
+			sum.bios[cost] += READ_ONCE(c->bios[cost]);
+		}
+	}
+	sum.bios[DDI_COST_TIMER] = sum.bios[DDI_COST_WORK];
+
+	for (cost = 0; cost < DDI_NR_COSTS; cost++) {
+		bios = sum.bios[cost];
+		total += sum.ns[cost];
+		len += sprintf(buf + len, "%s calls %llu ns %llu ns_per_call %llu ns_per_bio %llu\n",
+			       ddi_cost_names[cost], sum.calls[cost], sum.ns[cost],
+			       div_or_zero(sum.ns[cost], sum.calls[cost]),
+			       div_or_zero(sum.ns[cost], bios));
+	}
+	len += sprintf(buf + len, "total ns %llu ns_per_bio %llu\n", total,
+		       div_or_zero(total, sum.bios[DDI_COST_MAP]));
+	return len;
+}
+
+/* Any write clears the counters. */
+static ssize_t cpu_cost_store(struct kobject *kobj, struct kobj_attribute *attr,
+							  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, cpu_cost_attr);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dc->cost, cpu), 0, sizeof(struct cpu_cost));
+	return count;
+}
+
+/* Writing N releases every queued bio spread over N ms, 0 at once. */
+static ssize_t drain_store(struct kobject *kobj, struct kobj_attribute *attr,
+						   const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, drain_attr);
+	unsigned window;
+
+	if (kstrtouint(buf, 10, &window))
+		return -EINVAL;
+
+	drain_bios(dc, window);
+	return count;
+}
+
+static const char *const trigger_names[DDI_NR_TRIGGERS] = {
+	"none", "bytes_written", "flush", "sector", "time", "at",
+};
+
+static ssize_t trigger_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, trigger_attr);
+	struct ddi_trigger t;
+	ssize_t len;
+	int dir;
+
+	t = config_read(dc, trigger);
+	len = sprintf(buf, "%s", trigger_names[t.type]);
+	if (t.type == DDI_TRIGGER_AT) {
+		u32 nsec;
+		u64 sec = div_u64_rem(t.arg[1], NSEC_PER_SEC, &nsec);
+
+		len += sprintf(buf + len, " %s %llu.%09u", at_clock_names[t.arg[0]], sec, nsec);
+	} else if (t.type != DDI_TRIGGER_NONE) {
+		len += sprintf(buf + len, " %llu", t.arg[0]);
+		if (t.type == DDI_TRIGGER_SECTOR)
+			len += sprintf(buf + len, " %llu", t.arg[1]);
+	}
+	if (t.type != DDI_TRIGGER_NONE) {
+		for (dir = READ; dir <= WRITE; dir++)
+			if (t.delay[dir] >= 0)
+				len += sprintf(buf + len, " %s=%d", dir == READ ? "read" : "write",
+					       t.delay[dir]);
+	}
+	if (atomic64_read(&dc->trigger_fired))
+		len += sprintf(buf + len, " fired_us %llu",
+			       div_u64(READ_ONCE(dc->trigger_fired_ns), NSEC_PER_USEC));
+	if (READ_ONCE(dc->at_done))
+		len += sprintf(buf + len, " timer_late_ns %lld", READ_ONCE(dc->at_late_ns));
+	return len + sprintf(buf + len, "\n");
+}
+
+/*
+ * Accepts "<type> <arg>... [read=<ms>] [write=<ms>]", with two args
+ * "<start> <sectors>" for sector, "<clock> <sec>[.<fraction>]" for at and
+ * one for the others, or "none".
+ */
+static ssize_t trigger_store(struct kobject *kobj, struct kobj_attribute *attr,
+							 const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, trigger_attr);
+	struct ddi_trigger t = { .delay = { -1, -1 } };
+	struct ddi_config *cfg;
+	char *str, *p, *tok;
+	int i, nargs, ret = -EINVAL;
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+	p = strim(str);
+
+	tok = strsep(&p, " ");
+	for (t.type = 0; t.type < DDI_NR_TRIGGERS; t.type++)
+		if (!strcmp(tok, trigger_names[t.type]))
+			break;
+	if (t.type == DDI_NR_TRIGGERS)
+		goto out;
+
+	if (t.type == DDI_TRIGGER_AT) {
+		tok = strsep(&p, " ");
+		for (t.arg[0] = 0; tok && t.arg[0] < ARRAY_SIZE(at_clock_names); t.arg[0]++)
+			if (!strcmp(tok, at_clock_names[t.arg[0]]))
+				break;
+		if (!tok || t.arg[0] == ARRAY_SIZE(at_clock_names))
+			goto out;
+		tok = strsep(&p, " ");
+		if (!tok || parse_wall_time(tok, &t.arg[1]))
+			goto out;
+	}
+
+	nargs = t.type == DDI_TRIGGER_NONE || t.type == DDI_TRIGGER_AT ? 0 :
+		t.type == DDI_TRIGGER_SECTOR ? 2 : 1;
+	for (i = 0; i < nargs; i++) {
+		tok = strsep(&p, " ");
+		if (!tok || kstrtoull(tok, 10, &t.arg[i]))
+			goto out;
+	}
+	while ((tok = strsep(&p, " "))) {
+		if (!*tok)
+			continue;
+		if (!strncmp(tok, "read=", 5) && !kstrtoint(tok + 5, 10, &t.delay[READ]) &&
+		    t.delay[READ] >= 0)
+			continue;
+		if (!strncmp(tok, "write=", 6) && !kstrtoint(tok + 6, 10, &t.delay[WRITE]) &&
+		    t.delay[WRITE] >= 0)
+			continue;
+		goto out;
+	}
+	if (t.type != DDI_TRIGGER_NONE && t.delay[READ] < 0 && t.delay[WRITE] < 0)
+		goto out;
+	/* Group delays take precedence, a profile for them would never apply. */
+	for (i = READ; i <= WRITE; i++) {
+		if (t.delay[i] >= 0 && group_controls(dc, i)) {
+			ret = -EBUSY;
+			goto out;
+		}
+	}
+
+	cfg = config_edit(dc);
+	if (!cfg) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	t.seq = cfg->trigger.seq + 1;
+	atomic64_set(&dc->trigger_count, 0);
+	cfg->trigger = t;
+	config_commit(dc, cfg);
+	ret = count;
+out:
+	kfree(str);
+	return ret;
+}
+
+static ssize_t clock_offset_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, clock_offset_attr);
+	return sprintf(buf, "%lld\n", config_read(dc, clock_offset));
+}
+
+/* In nanoseconds, may be negative. An armed "at" trigger is re-armed. */
+static ssize_t clock_offset_store(struct kobject *kobj, struct kobj_attribute *attr,
+								  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, clock_offset_attr);
+	struct ddi_config *cfg;
+	s64 val;
+
+	if (kstrtos64(buf, 10, &val))
+		return -EINVAL;
+
+	cfg = config_edit(dc);
+	if (!cfg)
+		return -ENOMEM;
+	cfg->clock_offset = val;
+	config_commit(dc, cfg);
+	return count;
+}
+
+static ssize_t oneshot_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, oneshot_attr);
+	ssize_t len = 0;
+	int op;
+
+	/* "<op> <bios left> <delay>" */
+	for (op = 0; op < DDI_NR_OPS; op++)
+		len += sprintf(buf + len, "%s %d %u\n", ddi_op_names[op],
+			       atomic_read(&dc->oneshot_left[op]), READ_ONCE(dc->oneshot_delay[op]));
+	return len;
+}
+
+static int find_ddi_op(const char *name)
+{
+	int op;
+
+	for (op = 0; op < DDI_NR_OPS; op++)
+		if (!strcmp(name, ddi_op_names[op]))
+			return op;
+	return -1;
+}
+
+/* Delays the next @bios bios of @op by @delay; 0 bios cancels the remaining budget. */
+static void oneshot_arm(struct delay_c *dc, int op, unsigned bios, unsigned delay)
+{
+	/* Stop the old budget before changing its delay. */
+	atomic_set(&dc->oneshot_left[op], 0);
+	WRITE_ONCE(dc->oneshot_delay[op], delay);
+	smp_wmb();
+	atomic_set(&dc->oneshot_left[op], bios);
+}
+
+/* Accepts "<op> <bios> <delay>". */
+static ssize_t oneshot_store(struct kobject *kobj, struct kobj_attribute *attr,
+							 const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, oneshot_attr);
+	char name[16];
+	unsigned bios, delay;
+	int op;
+
+	if (sscanf(buf, "%15s %u %u", name, &bios, &delay) != 3 || bios > INT_MAX)
+		return -EINVAL;
+	op = find_ddi_op(name);
+	if (op < 0)
+		return -EINVAL;
+
+	oneshot_arm(dc, op, bios, delay);
+	return count;
+}
+
+static ssize_t record_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, record_attr);
+	return sprintf(buf, "%u\n", READ_ONCE(dc->record));
+}
+
+/* Enabling allocates the rings if needed; disabling keeps them for reading. */
+static ssize_t record_store(struct kobject *kobj, struct kobj_attribute *attr,
+							const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, record_attr);
+	bool enable;
+	int ret = 0;
+
+	if (kstrtobool(buf, &enable))
+		return -EINVAL;
+
+	mutex_lock(&dc->record_lock);
+	if (enable)
+		ret = ring_setup(dc, dc->record_pages);
+	if (!ret)
+		WRITE_ONCE(dc->record, enable);
+	mutex_unlock(&dc->record_lock);
+
+	return ret ? ret : count;
+}
+
+static ssize_t record_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, record_pages_attr);
+	return sprintf(buf, "%u\n", READ_ONCE(dc->record_pages));
+}
+
+/* Data pages per CPU, a power of two. Applied the next time recording is enabled. */
+static ssize_t record_pages_store(struct kobject *kobj, struct kobj_attribute *attr,
+								  const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, record_pages_attr);
+	unsigned pages;
+	int ret = 0;
+
+	if (kstrtouint(buf, 10, &pages) || !is_power_of_2(pages) ||
+	    pages > DDI_RECORD_MAX_PAGES)
+		return -EINVAL;
+
+	mutex_lock(&dc->record_lock);
+	if (dc->record)
+		ret = -EBUSY;
+	else
+		WRITE_ONCE(dc->record_pages, pages);
+	mutex_unlock(&dc->record_lock);
+
+	return ret ? ret : count;
+}
+
+static ssize_t record_drops_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, record_drops_attr);
+	struct ddi_ring *ring;
+	u64 drops = 0;
+	int cpu;
+
+	mutex_lock(&dc->record_lock);
+	ring = rcu_dereference_protected(dc->ring, lockdep_is_held(&dc->record_lock));
+	if (ring)
+		for_each_possible_cpu(cpu)
+			drops += READ_ONCE(ring_header(ring, cpu)->drops);
+	mutex_unlock(&dc->record_lock);
+
+	return sprintf(buf, "%llu\n", (unsigned long long)drops);
+}
+
+/* Delay groups. */
+
+static struct ddi_group *group_find(const char *name)
+{
+	struct ddi_group *grp;
+
+	list_for_each_entry(grp, &ddi_groups, node)
+		if (!strcmp(grp->name, name))
+			return grp;
+	return NULL;
+}
+
+/* Called with ddi_groups_lock held. */
+static void group_leave_locked(struct delay_c *dc)
+{
+	struct ddi_group *grp;
+
+	grp = rcu_dereference_protected(dc->group, lockdep_is_held(&ddi_groups_lock));
+	if (grp) {
+		RCU_INIT_POINTER(dc->group, NULL);
+		grp->members--;
+	}
+}
+
+static void group_leave(struct delay_c *dc)
+{
+	mutex_lock(&ddi_groups_lock);
+	group_leave_locked(dc);
+	mutex_unlock(&ddi_groups_lock);
+}
+
+static int group_join(struct delay_c *dc, const char *name)
+{
+	struct ddi_group *grp;
+	int ret = 0;
+
+	mutex_lock(&ddi_groups_lock);
+	grp = group_find(name);
+	if (grp) {
+		group_leave_locked(dc);
+		rcu_assign_pointer(dc->group, grp);
+		grp->members++;
+	} else {
+		ret = -ENOENT;
+	}
+	mutex_unlock(&ddi_groups_lock);
+
+	return ret;
+}
+
+static ssize_t group_show_delay(struct ddi_group *grp, int dir, char *buf)
+{
+	int delay;
+
+	rcu_read_lock();
+	delay = rcu_dereference(grp->config)->delay[dir];
+	rcu_read_unlock();
+
+	return delay < 0 ? sprintf(buf, "-\n") : show_delay(delay, buf);
+}
+
+/*
+ * Publish a new @dir base delay for every member, or "-" to hand them back
+ * their own, then re-time bios the members queued as their delay_retime
+ * says and pull their timers in.
+ */
+static ssize_t group_store_delay(struct ddi_group *grp, int dir, const char *buf, size_t count)
+{
+	struct ddi_group_config *old, *new;
+	struct delay_c *dc;
+	unsigned val;
+	int delay, old_delay;
+
+	if (sysfs_streq(buf, "-"))
+		delay = -1;
+	else if (!kstrtouint(buf, 10, &val) && val <= INT_MAX)
+		delay = val;
+	else
+		return -EINVAL;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	/* grp->lock is held until the members followed, so changes apply in order. */
+	mutex_lock(&grp->lock);
+	old = rcu_dereference_protected(grp->config, lockdep_is_held(&grp->lock));
+	*new = *old;
+	new->delay[dir] = delay;
+	old_delay = old->delay[dir];
+	rcu_assign_pointer(grp->config, new);
+	kfree_rcu(old, rcu);
+
+	mutex_lock(&ddi_targets_lock);
+	list_for_each_entry(dc, &ddi_targets, node) {
+		unsigned own, from, to;
+		enum ddi_retime policy;
+
+		if (rcu_access_pointer(dc->group) != grp)
+			continue;
+		own = dir == WRITE ? config_read(dc, write_delay) : config_read(dc, read_delay);
+		from = old_delay >= 0 ? old_delay : own;
+		to = delay >= 0 ? delay : own;
+		policy = config_read(dc, delay_retime);
+		if (policy != DDI_RETIME_KEEP && from != to)
+			retime_bios(dc, dir, old_delay >= 0 ? DDI_BASE_GROUP : DDI_BASE_OWN,
+				    delay >= 0 ? DDI_BASE_GROUP : DDI_BASE_OWN, from, to, policy);
+		/* A suspended member holds nothing; delay_dtr() stops a timer armed anyway. */
+		if (atomic_read(&dc->may_delay))
+			queue_timeout(dc, jiffies + msecs_to_jiffies(to));
+	}
+	mutex_unlock(&ddi_targets_lock);
+	mutex_unlock(&grp->lock);
+
+	return count;
+}
+
+static ssize_t group_read_delay_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct ddi_group *grp = container_of(attr, struct ddi_group, read_delay_attr);
+	return group_show_delay(grp, READ, buf);
+}
+
+static ssize_t group_read_delay_store(struct kobject *kobj, struct kobj_attribute *attr,
+									  const char *buf, size_t count)
+{
+	struct ddi_group *grp = container_of(attr, struct ddi_group, read_delay_attr);
+	return group_store_delay(grp, READ, buf, count);
+}
+
+static ssize_t group_write_delay_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct ddi_group *grp = container_of(attr, struct ddi_group, write_delay_attr);
+	return group_show_delay(grp, WRITE, buf);
+}
+
+static ssize_t group_write_delay_store(struct kobject *kobj, struct kobj_attribute *attr,
+									   const char *buf, size_t count)
+{
+	struct ddi_group *grp = container_of(attr, struct ddi_group, write_delay_attr);
+	return group_store_delay(grp, WRITE, buf, count);
+}
+
+static ssize_t group_members_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct ddi_group *grp = container_of(attr, struct ddi_group, members_attr);
+	struct delay_c *dc;
+	ssize_t len = 0;
+
+	mutex_lock(&ddi_targets_lock);
+	list_for_each_entry(dc, &ddi_targets, node)
+		if (rcu_access_pointer(dc->group) == grp)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%s\n", dc->name);
+	mutex_unlock(&ddi_targets_lock);
+
+	return len;
+}
+
+static void group_free(struct ddi_group *grp)
+{
+	kobject_put(grp->kobj);
+	kfree_rcu(rcu_dereference_protected(grp->config, 1), rcu);
+	kfree_rcu(grp, rcu);
+}
+
+static ssize_t groups_create_store(struct kobject *kobj, struct kobj_attribute *attr,
+								   const char *buf, size_t count)
+{
+	struct ddi_group *grp;
+	struct ddi_group_config *cfg;
+	int ret;
+
+	grp = kzalloc(sizeof(*grp), GFP_KERNEL);
+	cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!grp || !cfg) {
+		kfree(grp);
+		kfree(cfg);
+		return -ENOMEM;
+	}
+	cfg->delay[READ] = cfg->delay[WRITE] = -1;
+	RCU_INIT_POINTER(grp->config, cfg);
+	mutex_init(&grp->lock);
+
+	/* "none" is what a member writes to leave its group. */
+	if (sscanf(buf, "%31s", grp->name) != 1 || strchr(grp->name, '/') ||
+	    !strcmp(grp->name, "none")) {
+		ret = -EINVAL;
+		goto bad;
+	}
+
+	grp->read_delay_attr = (struct kobj_attribute)__ATTR(read_delay, 0644,
+			group_read_delay_show, group_read_delay_store);
+	grp->write_delay_attr = (struct kobj_attribute)__ATTR(write_delay, 0644,
+			group_write_delay_show, group_write_delay_store);
+	grp->members_attr = (struct kobj_attribute)__ATTR(members, 0444, group_members_show, NULL);
+	grp->attrs[0] = &grp->read_delay_attr.attr;
+	grp->attrs[1] = &grp->write_delay_attr.attr;
+	grp->attrs[2] = &grp->members_attr.attr;
+	grp->attrs[3] = NULL;
+	grp->attr_group.attrs = grp->attrs;
+
+	mutex_lock(&ddi_groups_lock);
+	if (group_find(grp->name)) {
+		ret = -EEXIST;
+		goto bad_unlock;
+	}
+	grp->kobj = kobject_create_and_add(grp->name, groups_kobj);
+	if (!grp->kobj) {
+		ret = -ENOMEM;
+		goto bad_unlock;
+	}
+	ret = sysfs_create_group(grp->kobj, &grp->attr_group);
+	if (ret) {
+		kobject_put(grp->kobj);
+		goto bad_unlock;
+	}
+	list_add_tail(&grp->node, &ddi_groups);
+	mutex_unlock(&ddi_groups_lock);
+
+	return count;
+
+bad_unlock:
+	mutex_unlock(&ddi_groups_lock);
+bad:
+	kfree(cfg);
+	kfree(grp);
+	return ret;
+}
+
+/* A group can only be removed once every member left it. */
+static ssize_t groups_remove_store(struct kobject *kobj, struct kobj_attribute *attr,
+								   const char *buf, size_t count)
+{
+	struct ddi_group *grp;
+	char name[32];
+	int ret = 0;
+
+	if (sscanf(buf, "%31s", name) != 1)
+		return -EINVAL;
+
+	mutex_lock(&ddi_groups_lock);
+	grp = group_find(name);
+	if (!grp)
+		ret = -ENOENT;
+	else if (grp->members)
+		ret = -EBUSY;
+	else
+		list_del(&grp->node);
+	mutex_unlock(&ddi_groups_lock);
+
+	if (ret)
+		return ret;
+	/* Removing the directory waits for running stores, which take ddi_targets_lock. */
+	group_free(grp);
+	return count;
+}
+
+static struct kobj_attribute groups_create_attr = __ATTR(create, 0200, NULL, groups_create_store);
+static struct kobj_attribute groups_remove_attr = __ATTR(remove, 0200, NULL, groups_remove_store);
+
+static struct attribute *groups_attrs[] = {
+	&groups_create_attr.attr,
+	&groups_remove_attr.attr,
+	NULL,
+};
+
+static struct attribute_group groups_attr_group = {
+	.attrs = groups_attrs,
+};
+
+static void destroy_groups(void)
+{
+	struct ddi_group *grp, *next;
+
+	list_for_each_entry_safe(grp, next, &ddi_groups, node) {
+		list_del(&grp->node);
+		group_free(grp);
+	}
+}
+
+static ssize_t group_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, group_attr);
+	struct ddi_group *grp;
+	ssize_t len;
+
+	mutex_lock(&ddi_groups_lock);
+	grp = rcu_dereference_protected(dc->group, lockdep_is_held(&ddi_groups_lock));
+	len = sprintf(buf, "%s\n", grp ? grp->name : "none");
+	mutex_unlock(&ddi_groups_lock);
+
+	return len;
+}
+
+/* Writing a group name joins it, "none" leaves the current group. */
+static ssize_t group_store(struct kobject *kobj, struct kobj_attribute *attr,
+						   const char *buf, size_t count)
+{
+	struct delay_c *dc = container_of(attr, struct delay_c, group_attr);
+	char name[32];
+	int ret;
+
+	if (sscanf(buf, "%31s", name) != 1)
+		return -EINVAL;
+
+	if (!strcmp(name, "none")) {
+		group_leave(dc);
+		return count;
+	}
+	ret = group_join(dc, name);
+	return ret ? ret : count;
+}
+
+/* Fills the attributes, which the message interface also uses without sysfs. */
+static void init_dev_attrs(struct delay_c *dc)
+{
+	struct attribute **attrs = dc->attrs;
+
+	dc->attr_group.attrs = attrs;
+	attrs[0] = &dc->read_delay_attr.attr;
+	attrs[1] = &dc->write_delay_attr.attr;
+	attrs[2] = &dc->ioprio_delay_attr.attr;
+	attrs[3] = &dc->freeze_read_attr.attr;
+	attrs[4] = &dc->freeze_write_attr.attr;
+	attrs[5] = &dc->thaw_rate_attr.attr;
+	attrs[6] = &dc->frozen_attr.attr;
+	attrs[7] = &dc->gc_interval_mb_attr.attr;
+	attrs[8] = &dc->gc_pause_attr.attr;
+	attrs[9] = &dc->gc_jitter_attr.attr;
+	attrs[10] = &dc->gc_stall_reads_attr.attr;
+	attrs[11] = &dc->gc_events_attr.attr;
+	attrs[12] = &dc->slc_capacity_mb_attr.attr;
+	attrs[13] = &dc->slc_fast_delay_attr.attr;
+	attrs[14] = &dc->slc_slow_delay_attr.attr;
+	attrs[15] = &dc->slc_slow_bw_attr.attr;
+	attrs[16] = &dc->slc_drain_rate_attr.attr;
+	attrs[17] = &dc->slc_fill_attr.attr;
+	attrs[18] = &dc->rcache_extents_attr.attr;
+	attrs[19] = &dc->rcache_extent_kb_attr.attr;
+	attrs[20] = &dc->rcache_hit_delay_attr.attr;
+	attrs[21] = &dc->rcache_stats_attr.attr;
+	attrs[22] = &dc->latency_histogram_attr.attr;
+	attrs[23] = &dc->completion_histogram_attr.attr;
+	attrs[24] = &dc->stats_attr.attr;
+	attrs[25] = &dc->queue_attr.attr;
+	attrs[26] = &dc->queue_reset_attr.attr;
+	attrs[27] = &dc->dispatch_attr.attr;
+	attrs[28] = &dc->record_attr.attr;
+	attrs[29] = &dc->record_pages_attr.attr;
+	attrs[30] = &dc->record_drops_attr.attr;
+	attrs[31] = &dc->cost_accounting_attr.attr;
+	attrs[32] = &dc->cpu_cost_attr.attr;
+	attrs[33] = &dc->delay_retime_attr.attr;
+	attrs[34] = &dc->drain_attr.attr;
+	attrs[35] = &dc->suspend_wait_attr.attr;
+	attrs[36] = &dc->reload_keep_attr.attr;
+	attrs[37] = &dc->trigger_attr.attr;
+	attrs[38] = &dc->oneshot_attr.attr;
+	attrs[39] = &dc->group_attr.attr;
+	attrs[40] = &dc->clock_offset_attr.attr;
+	attrs[41] = NULL;
+
+	dc->read_delay_attr = (struct kobj_attribute)__ATTR(read_delay, 0644, read_delay_show, read_delay_store);
+	dc->write_delay_attr = (struct kobj_attribute)__ATTR(write_delay, 0644, write_delay_show, write_delay_store);
+	dc->ioprio_delay_attr = (struct kobj_attribute)__ATTR(ioprio_delay, 0644, ioprio_delay_show, ioprio_delay_store);
+	dc->freeze_read_attr = (struct kobj_attribute)__ATTR(freeze_read, 0644, freeze_read_show, freeze_read_store);
+	dc->freeze_write_attr = (struct kobj_attribute)__ATTR(freeze_write, 0644, freeze_write_show, freeze_write_store);
+	dc->thaw_rate_attr = (struct kobj_attribute)__ATTR(thaw_rate, 0644, thaw_rate_show, thaw_rate_store);
+	dc->frozen_attr = (struct kobj_attribute)__ATTR_RO(frozen);
+	dc->gc_interval_mb_attr = (struct kobj_attribute)__ATTR_RW(gc_interval_mb);
+	dc->gc_pause_attr = (struct kobj_attribute)__ATTR_RW(gc_pause);
+	dc->gc_jitter_attr = (struct kobj_attribute)__ATTR_RW(gc_jitter);
+	dc->gc_stall_reads_attr = (struct kobj_attribute)__ATTR_RW(gc_stall_reads);
+	dc->gc_events_attr = (struct kobj_attribute)__ATTR_RO(gc_events);
+	dc->slc_capacity_mb_attr = (struct kobj_attribute)__ATTR_RW(slc_capacity_mb);
+	dc->slc_fast_delay_attr = (struct kobj_attribute)__ATTR_RW(slc_fast_delay);
+	dc->slc_slow_delay_attr = (struct kobj_attribute)__ATTR_RW(slc_slow_delay);
+	dc->slc_slow_bw_attr = (struct kobj_attribute)__ATTR_RW(slc_slow_bw);
+	dc->slc_drain_rate_attr = (struct kobj_attribute)__ATTR_RW(slc_drain_rate);
+	dc->slc_fill_attr = (struct kobj_attribute)__ATTR_RO(slc_fill);
+	dc->rcache_extents_attr = (struct kobj_attribute)__ATTR_RW(rcache_extents);
+	dc->rcache_extent_kb_attr = (struct kobj_attribute)__ATTR_RW(rcache_extent_kb);
+	dc->rcache_hit_delay_attr = (struct kobj_attribute)__ATTR_RW(rcache_hit_delay);
+	dc->rcache_stats_attr = (struct kobj_attribute)__ATTR_RO(rcache_stats);
+	dc->latency_histogram_attr = (struct kobj_attribute)__ATTR_RW(latency_histogram);
+	dc->completion_histogram_attr = (struct kobj_attribute)__ATTR_RW(completion_histogram);
+	dc->stats_attr = (struct kobj_attribute)__ATTR_RO(stats);
+	dc->queue_attr = (struct kobj_attribute)__ATTR_RO(queue);
+	dc->queue_reset_attr = (struct kobj_attribute)__ATTR_WO(queue_reset);
+	dc->dispatch_attr = (struct kobj_attribute)__ATTR_RW(dispatch);
+	dc->record_attr = (struct kobj_attribute)__ATTR_RW(record);
+	dc->record_pages_attr = (struct kobj_attribute)__ATTR_RW(record_pages);
+	dc->record_drops_attr = (struct kobj_attribute)__ATTR_RO(record_drops);
+	dc->cost_accounting_attr = (struct kobj_attribute)__ATTR_RW(cost_accounting);
+	dc->cpu_cost_attr = (struct kobj_attribute)__ATTR_RW(cpu_cost);
+	dc->delay_retime_attr = (struct kobj_attribute)__ATTR_RW(delay_retime);
+	dc->drain_attr = (struct kobj_attribute)__ATTR_WO(drain);
+	dc->suspend_wait_attr = (struct kobj_attribute)__ATTR_RW(suspend_wait);
+	dc->reload_keep_attr = (struct kobj_attribute)__ATTR_RW(reload_keep);
+	dc->trigger_attr = (struct kobj_attribute)__ATTR_RW(trigger);
+	dc->oneshot_attr = (struct kobj_attribute)__ATTR_RW(oneshot);
+	dc->group_attr = (struct kobj_attribute)__ATTR_RW(group);
+	dc->clock_offset_attr = (struct kobj_attribute)__ATTR_RW(clock_offset);
+}
+
+static int init_dev_kobject(struct delay_c *dc)
+{
+	int ret;
+
+	dc->kobj = kobject_create_and_add(dc->name, ddi_kobj);
+	if (!dc->kobj)
+		return -ENOMEM;
+
+	ret = sysfs_create_group(dc->kobj, &dc->attr_group);
+	if (ret) {
+		kobject_put(dc->kobj);
+		dc->kobj = NULL;
+	}
+
+	return ret;
+}
+
+static void destroy_dev_kobject(struct delay_c *dc)
+{
+	kobject_put(dc->kobj);
+}
+
+/* Looks up a writable sysfs attribute of @dc, for the message interface. */
+static struct kobj_attribute *find_dev_attr(struct delay_c *dc, const char *name)
+{
+	struct attribute **attr;
+
+	for (attr = dc->attrs; *attr; attr++) {
+		struct kobj_attribute *kattr = container_of(*attr, struct kobj_attribute, attr);
+
+		if (!strcmp((*attr)->name, name))
+			return kattr->store ? kattr : NULL;
+	}
+	return NULL;
+}
+
+/* Attributes backed by struct ddi_config, the only ones "set" may write. */
+static const char *const config_attr_names[] = {
+	"read_delay", "write_delay", "delay_retime", "ioprio_delay", "thaw_rate",
+	"gc_interval_mb", "gc_pause", "gc_jitter", "gc_stall_reads",
+	"slc_capacity_mb", "slc_fast_delay", "slc_slow_delay", "slc_slow_bw", "slc_drain_rate",
+	"rcache_hit_delay", "suspend_wait", "reload_keep", "trigger", "clock_offset",
+};
+
+static struct kobj_attribute *find_config_attr(struct delay_c *dc, const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(config_attr_names); i++)
+		if (!strcmp(config_attr_names[i], name))
+			return find_dev_attr(dc, name);
+	return NULL;
+}
+
+/*
+ * Debugfs view of pending bios. Listing holds delayed_bios_lock only while
+ * filling one seq_file buffer; a cursor keeps the position in delayed_bios
+ * in between, so bios may be dispatched or queued while it is read.
+ */
+
+struct pending_iter {
+	struct delay_c *dc;
+	struct dm_delay_info cursor;
+	u64 now;
+};
+
+/* First bio queued after @pos, skipping cursors. Called with delayed_bios_lock held. */
+static struct dm_delay_info *pending_next(struct delay_c *dc, struct list_head *pos)
+{
+	struct dm_delay_info *delayed;
+
+	for (pos = pos->next; pos != &dc->delayed_bios; pos = pos->next) {
+		delayed = list_entry(pos, struct dm_delay_info, list);
+		if (!is_cursor(delayed))
+			return delayed;
+	}
+	return NULL;
+}
+
+static void *pending_start(struct seq_file *m, loff_t *pos)
+{
+	struct pending_iter *iter = m->private;
+	struct delay_c *dc = iter->dc;
+
+	mutex_lock(&delayed_bios_lock);
+	iter->now = ktime_get_ns();
+	if (!*pos) {
+		list_move(&iter->cursor.list, &dc->delayed_bios);
+		return SEQ_START_TOKEN;
+	}
+	return pending_next(dc, &iter->cursor.list);
+}
+
+static void *pending_next_seq(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct pending_iter *iter = m->private;
+
+	++*pos;
+	if (v != SEQ_START_TOKEN)
+		list_move(&iter->cursor.list, &((struct dm_delay_info *)v)->list);
+	return pending_next(iter->dc, &iter->cursor.list);
+}
+
+static void pending_stop(struct seq_file *m, void *v)
+{
+	mutex_unlock(&delayed_bios_lock);
+}
+
+static int pending_show(struct seq_file *m, void *v)
+{
+	struct pending_iter *iter = m->private;
+	struct dm_delay_info *delayed = v;
+	struct bio *bio;
+	int dir;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_puts(m, "sector bytes op flags pid queued_us remaining_us\n");
+		return 0;
+	}
+
+	bio = dm_bio_from_per_bio_data(delayed, sizeof(struct dm_delay_info));
+	dir = bio_data_dir(bio);
+	seq_printf(m, "%llu %u %s 0x%x %d %llu ", (unsigned long long)delayed->sector,
+		   delayed->bytes, ddi_op_names[bio_ddi_op(bio)], (unsigned)bio->bi_opf,
+		   delayed->pid, (unsigned long long)div_u64(iter->now - delayed->queued, NSEC_PER_USEC));
+	if (READ_ONCE(iter->dc->frozen[dir]))
+		seq_puts(m, "frozen\n");
+	else
+		seq_printf(m, "%llu\n", (unsigned long long)(delayed->expires_ns > iter->now ?
+				div_u64(delayed->expires_ns - iter->now, NSEC_PER_USEC) : 0));
+	return 0;
+}
+
+static const struct seq_operations pending_seq_ops = {
+	.start = pending_start,
+	.next  = pending_next_seq,
+	.stop  = pending_stop,
+	.show  = pending_show,
+};
+
+static int pending_open(struct inode *inode, struct file *file)
+{
+	struct pending_iter *iter;
+
+	iter = __seq_open_private(file, &pending_seq_ops, sizeof(*iter));
+	if (!iter)
+		return -ENOMEM;
+
+	iter->dc = inode->i_private;
+	iter->cursor.context = NULL;
+	INIT_LIST_HEAD(&iter->cursor.list);
+	return 0;
+}
+
+static int pending_release(struct inode *inode, struct file *file)
+{
+	struct pending_iter *iter = ((struct seq_file *)file->private_data)->private;
+
+	mutex_lock(&delayed_bios_lock);
+	list_del_init(&iter->cursor.list);
+	mutex_unlock(&delayed_bios_lock);
+
+	return seq_release_private(inode, file);
+}
+
+static const struct file_operations pending_fops = {
+	.owner   = THIS_MODULE,
+	.open    = pending_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = pending_release,
+};
+
+struct pending_summary {
+	u64 count[DDI_NR_OPS];
+	u64 bytes[DDI_NR_OPS];
+	u64 oldest_us[DDI_NR_OPS];
+	u64 regions[DDI_SUMMARY_REGIONS][DDI_NR_OPS];
+};
+
+static void pending_summary_add(struct delay_c *dc, struct pending_summary *sum,
+				struct dm_delay_info *delayed, unsigned region_shift, u64 now)
+{
+	struct bio *bio = dm_bio_from_per_bio_data(delayed, sizeof(struct dm_delay_info));
+	enum ddi_op op = bio_ddi_op(bio);
+	u64 region = delayed->sector >> region_shift;
+
+	sum->count[op]++;
+	sum->bytes[op] += delayed->bytes;
+	sum->oldest_us[op] = max(sum->oldest_us[op], div_u64(now - delayed->queued, NSEC_PER_USEC));
+	sum->regions[min_t(u64, region, DDI_SUMMARY_REGIONS - 1)][op]++;
+}
+
+/*
+ * Aggregate pending bios by op and by LBA region, visiting at most
+ * DDI_SUMMARY_BATCH bios per delayed_bios_lock hold.
+ */
+static int pending_summary_show(struct seq_file *m, void *v)
+{
+	struct delay_c *dc = m->private;
+	struct pending_summary *sum;
+	struct dm_delay_info cursor = { .context = NULL }, *delayed;
+	unsigned region_shift = 0, n;
+	u64 now = ktime_get_ns();
+	int op, region;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	while (dc->len >> region_shift > DDI_SUMMARY_REGIONS)
+		region_shift++;
+
+	mutex_lock(&delayed_bios_lock);
+	list_add(&cursor.list, &dc->delayed_bios);
+	for (;;) {
+		n = 0;
+		while ((delayed = pending_next(dc, &cursor.list)) && n++ < DDI_SUMMARY_BATCH) {
+			pending_summary_add(dc, sum, delayed, region_shift, now);
+			list_move(&cursor.list, &delayed->list);
+		}
+		if (!delayed)
+			break;
+		mutex_unlock(&delayed_bios_lock);
+		cond_resched();
+		mutex_lock(&delayed_bios_lock);
+	}
+	list_del(&cursor.list);
+	mutex_unlock(&delayed_bios_lock);
+
+	seq_puts(m, "op count bytes oldest_us\n");
+	for (op = 0; op < DDI_NR_OPS; op++)
+		seq_printf(m, "%s %llu %llu %llu\n", ddi_op_names[op],
+			   (unsigned long long)sum->count[op], (unsigned long long)sum->bytes[op],
+			   (unsigned long long)sum->oldest_us[op]);
+
+	seq_puts(m, "\nstart_sector");
+	for (op = 0; op < DDI_NR_OPS; op++)
+		seq_printf(m, " %s", ddi_op_names[op]);
+	seq_puts(m, "\n");
+	for (region = 0; region < DDI_SUMMARY_REGIONS; region++) {
+		if ((sector_t)region << region_shift >= dc->len)
+			break;
+		seq_printf(m, "%llu", (unsigned long long)region << region_shift);
+		for (op = 0; op < DDI_NR_OPS; op++)
+			seq_printf(m, " %llu", (unsigned long long)sum->regions[region][op]);
+		seq_puts(m, "\n");
+	}
+
+	kfree(sum);
+	return 0;
+}
+
+static int pending_summary_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pending_summary_show, inode->i_private);
+}
+
+static const struct file_operations pending_summary_fops = {
+	.owner   = THIS_MODULE,
+	.open    = pending_summary_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Created with debugfs_create_file_unsafe() since debugfs does not proxy
+ * mmap, so removal is guarded here with debugfs_file_get().
+ */
+static int records_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct delay_c *dc = file->private_data;
+	struct ddi_ring *ring;
+	int ret;
+
+	ret = debugfs_file_get(file->f_path.dentry);
+	if (ret)
+		return ret;
+
+	mutex_lock(&dc->record_lock);
+	ring = rcu_dereference_protected(dc->ring, lockdep_is_held(&dc->record_lock));
+	if (ring)
+		ret = remap_vmalloc_range(vma, ring->buf, vma->vm_pgoff);
+	else
+		ret = -ENODEV;
+	mutex_unlock(&dc->record_lock);
+
+	debugfs_file_put(file->f_path.dentry);
+	return ret;
+}
+
+static const struct file_operations records_fops = {
+	.owner = THIS_MODULE,
+	.open  = simple_open,
+	.mmap  = records_mmap,
+};
+
+static void init_dev_debugfs(struct delay_c *dc)
+{
+	/* Debugfs is best effort, failures are not reported. */
+	dc->debugfs_dir = debugfs_create_dir(dc->name, ddi_debugfs);
+	debugfs_create_file("pending", 0444, dc->debugfs_dir, dc, &pending_fops);
+	debugfs_create_file("pending_summary", 0444, dc->debugfs_dir, dc, &pending_summary_fops);
+	debugfs_create_file_unsafe("records", 0600, dc->debugfs_dir, dc, &records_fops);
+}
+
+static void destroy_dev_debugfs(struct delay_c *dc)
+{
+	struct dm_delay_info *delayed, *next;
+
+	debugfs_remove_recursive(dc->debugfs_dir);
+
+	/* Files still open can only be released now; detach their cursors from dc. */
+	mutex_lock(&delayed_bios_lock);
+	list_for_each_entry_safe(delayed, next, &dc->delayed_bios, list)
+		if (is_cursor(delayed))
+			list_del_init(&delayed->list);
+	mutex_unlock(&delayed_bios_lock);
+}
+
+/* Device Mapper implementation. */
+
+static void handle_delayed_timer(struct timer_list *t)
+{
+	struct delay_c *dc = from_timer(dc, t, delay_timer);
+	u64 start = cost_start(dc);
+
+	atomic64_inc(&dc->timer_fires);
+	queue_work(dc->kdelayd_wq, &dc->flush_expired_bios);
+	cost_end(dc, DDI_COST_TIMER, start, 0);
+}
+
+static void __queue_timeout(struct delay_c *dc, unsigned long expires, u64 *cost)
+{
+	cost_lock(&dc->timer_lock, cost);
+
+	if (!timer_pending(&dc->delay_timer) || expires < dc->delay_timer.expires)
+		mod_timer(&dc->delay_timer, expires);
+
+	mutex_unlock(&dc->timer_lock);
+}
+
+static void queue_timeout(struct delay_c *dc, unsigned long expires)
+{
+	__queue_timeout(dc, expires, NULL);
+}
+
+static unsigned flush_bios(struct bio *bio)
+{
+	struct bio *n;
+	unsigned count = 0;
+
+	while (bio) {
+		n = bio->bi_next;
+		bio->bi_next = NULL;
+// https://github.com/torvalds/linux/commit/ed00aabd5eb9fb44d6aff1173234a2e911b9fead
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+		generic_make_request(bio);
+#else
+		submit_bio_noacct(bio);
+#endif
+		bio = n;
+		count++;
+	}
+	return count;
+}
+
+static struct bio *flush_delayed_bios(struct delay_c *dc, int flush_all, u64 *cost)
+{
+	struct dm_delay_info *delayed, *next;
+	unsigned long next_expires = 0;
+	int start_timer = 0;
+	struct bio_list flush_bios = { };
+	s64 released = 0;
+
+	cost_lock(&delayed_bios_lock, cost);
+	list_for_each_entry_safe(delayed, next, &dc->delayed_bios, list) {
+		struct bio *bio = dm_bio_from_per_bio_data(delayed,
+					sizeof(struct dm_delay_info));
+		int dir;
+
+		if (is_cursor(delayed))
+			continue;
+
+		dir = bio_data_dir(bio);
+		if (flush_all || (!dc->frozen[dir] && time_after_eq(jiffies, delayed->expires))) {
+			delayed->dispatched = ktime_get_ns();
+			hist_record(&dc->latency->hold[dir], delayed->dispatched - delayed->queued);
+			if (!flush_all) {
+				hist_record(&dc->latency->lateness, delayed->dispatched > delayed->expires_ns ?
+					    delayed->dispatched - delayed->expires_ns : 0);
+				released++;
+			}
+			list_del(&delayed->list);
+			bio_list_add(&flush_bios, bio);
+			gauge_dispatch(dc, dir, delayed);
+			stats_account(dc->stats, bio_ddi_op(bio), DDI_STAT_DISPATCHED, delayed->bytes);
+			trace_ddi_dispatch(dc->devt, delayed->sector, delayed->bytes, bio_op(bio),
+					   delayed->delay, delayed->dispatched - delayed->queued,
+					   queue_depth(dc));
+			continue;
+		}
+
+		/* Frozen bios have no timeout, they wait for thaw_bios(). */
+		if (dc->frozen[dir])
+			continue;
+
+		if (!start_timer) {
+			start_timer = 1;
+			next_expires = delayed->expires;
+		} else
+			next_expires = min(next_expires, delayed->expires);
+	}
+
+	mutex_unlock(&delayed_bios_lock);
+
+	if (!flush_all) {
+		atomic64_add(released, &dc->work_bios);
+		gauge_peak(&dc->work_max_bios, released);
+	}
+
+	if (start_timer)
+		__queue_timeout(dc, next_expires, cost);
+
+	return bio_list_get(&flush_bios);
+}
+
+static void flush_expired_bios(struct work_struct *work)
+{
+	struct delay_c *dc;
+	struct bio *bio;
+	unsigned bios;
+	u64 start, submit;
+
+	dc = container_of(work, struct delay_c, flush_expired_bios);
+	start = cost_start(dc);
+	atomic64_inc(&dc->work_runs);
+	bio = flush_delayed_bios(dc, 0, &start);
+
+	/* Submitting to the backend is its cost, not ddi's. */
+	submit = start ? ktime_get_ns() : 0;
+	bios = flush_bios(bio);
+	if (start)
+		start += ktime_get_ns() - submit;
+	cost_end(dc, DDI_COST_WORK, start, bios);
+}
+
+static void freeze_bios(struct delay_c *dc, int dir)
+{
+	mutex_lock(&delayed_bios_lock);
+	dc->frozen[dir] = true;
+	mutex_unlock(&delayed_bios_lock);
+}
+
+/*
+ * Unfreeze a direction and reschedule every bio held for it, either all at
+ * once or paced at thaw_rate bios per second in the order they were queued.
+ */
+static void thaw_bios(struct delay_c *dc, int dir)
+{
+	struct dm_delay_info *delayed;
+	unsigned long now = jiffies;
+	u64 now_ns = ktime_get_ns();
+	unsigned rate = config_read(dc, thaw_rate);
+	u64 n = 0;
+
+	mutex_lock(&delayed_bios_lock);
+	if (!dc->frozen[dir]) {
+		mutex_unlock(&delayed_bios_lock);
+		return;
+	}
+	dc->frozen[dir] = false;
+
+	list_for_each_entry(delayed, &dc->delayed_bios, list) {
+		struct bio *bio = dm_bio_from_per_bio_data(delayed,
+					sizeof(struct dm_delay_info));
+
+		if (is_cursor(delayed) || bio_data_dir(bio) != dir)
+			continue;
+		if (rate) {
+			delayed->expires = now + (unsigned long)div_u64(n * HZ, rate);
+			delayed->expires_ns = now_ns + div_u64(n * NSEC_PER_SEC, rate);
+			n++;
+		} else {
+			delayed->expires = now;
+			delayed->expires_ns = now_ns;
+		}
+	}
+	mutex_unlock(&delayed_bios_lock);
+
+	queue_work(dc->kdelayd_wq, &dc->flush_expired_bios);
+}
+
+/* Whether the delay of @bio is based on read_delay (READ) or write_delay (WRITE). */
+static int delay_dir(struct delay_c *dc, struct bio *bio)
+{
+	return bio_data_dir(bio) == WRITE && dc->dev_write ? WRITE : READ;
+}
+
+/* Callback of walk_queued_bios(), called with delayed_bios_lock held. */
+typedef void (*queued_bio_fn)(struct delay_c *dc, struct dm_delay_info *delayed,
+			      struct bio *bio, unsigned long now, u64 now_ns, void *arg);
+
+/*
+ * Call @fn for every bio queued before the call, oldest first.
+ * delayed_bios_lock is dropped every DDI_SUMMARY_BATCH bios, with a cursor
+ * keeping the position, so mapping is never blocked for long. Afterwards the
+ * release work runs to dispatch what is due and rearm the timer.
+ */
+static void walk_queued_bios(struct delay_c *dc, queued_bio_fn fn, void *arg)
+{
+	struct dm_delay_info cursor = { .context = NULL }, *delayed;
+	u64 since = ktime_get_ns(), now_ns;
+	unsigned long now;
+	unsigned n;
+
+	mutex_lock(&delayed_bios_lock);
+	list_add(&cursor.list, &dc->delayed_bios);
+	for (;;) {
+		now = jiffies;
+		now_ns = ktime_get_ns();
+		n = 0;
+		while ((delayed = pending_next(dc, &cursor.list)) && n++ < DDI_SUMMARY_BATCH) {
+			list_move(&cursor.list, &delayed->list);
+			if (delayed->queued <= since)
+				fn(dc, delayed, dm_bio_from_per_bio_data(delayed,
+					sizeof(struct dm_delay_info)), now, now_ns, arg);
+		}
+		if (!delayed)
+			break;
+		mutex_unlock(&delayed_bios_lock);
+		cond_resched();
+		mutex_lock(&delayed_bios_lock);
+	}
+	list_del(&cursor.list);
+	mutex_unlock(&delayed_bios_lock);
+
+	queue_work(dc->kdelayd_wq, &dc->flush_expired_bios);
+}
+
+struct retime_args {
+	int dir;
+	enum ddi_base from;
+	enum ddi_base to;
+	unsigned old_delay;
+	unsigned new_delay;
+	enum ddi_retime policy;
+};
+
+static void retime_bio(struct delay_c *dc, struct dm_delay_info *delayed,
+		       struct bio *bio, unsigned long now, u64 now_ns, void *arg)
+{
+	struct retime_args *args = arg;
+	s64 delay;
+
+	if (delay_dir(dc, bio) != args->dir || dc->frozen[bio_data_dir(bio)] ||
+	    delayed->base != args->from)
+		return;
+
+	delayed->base = args->to;
+	if (args->policy == DDI_RETIME_RELEASE) {
+		delayed->expires = now;
+		delayed->expires_ns = now_ns;
+		return;
+	}
+
+	delay = max_t(s64, (s64)delayed->delay + args->new_delay - args->old_delay, 0);
+	delayed->delay = delay;
+	delayed->expires_ns = delayed->queued + delay * NSEC_PER_MSEC;
+	if (delayed->expires_ns > now_ns)
+		delayed->expires = now + nsecs_to_jiffies(delayed->expires_ns - now_ns);
+	else
+		delayed->expires = now;
+}
+
+/*
+ * Apply a change of the @dir base delay to bios queued before it whose base
+ * came from @from, which it now comes from @to. Recompute shifts each bio's
+ * delay by the change, keeping anything the models added, and expires it
+ * relative to its enqueue time; release expires it now. Bios whose delay was
+ * replaced as a whole and those of frozen directions are left alone.
+ */
+static void retime_bios(struct delay_c *dc, int dir, enum ddi_base from, enum ddi_base to,
+			unsigned old_delay, unsigned new_delay, enum ddi_retime policy)
+{
+	struct retime_args args = {
+		.dir = dir,
+		.from = from,
+		.to = to,
+		.old_delay = old_delay,
+		.new_delay = new_delay,
+		.policy = policy,
+	};
+
+	walk_queued_bios(dc, retime_bio, &args);
+}
+
+struct drain_args {
+	u64 window_ns;
+	u64 count;
+	u64 n;
+};
+
+static void drain_bio(struct delay_c *dc, struct dm_delay_info *delayed,
+		      struct bio *bio, unsigned long now, u64 now_ns, void *arg)
+{
+	struct drain_args *args = arg;
+	u64 offset;
+
+	if (dc->frozen[bio_data_dir(bio)])
+		return;
+
+	/* Bios queued while walking may exceed the count taken beforehand. */
+	offset = div64_u64(min(args->n++, args->count) * args->window_ns, args->count);
+	if (delayed->expires_ns > now_ns + offset) {
+		delayed->expires_ns = now_ns + offset;
+		delayed->expires = now + nsecs_to_jiffies(offset);
+	}
+}
+
+/*
+ * Release every queued bio now, or spread evenly over @window_ms in the order
+ * they were queued. No bio is held beyond its own expiry. New bios are
+ * delayed as usual meanwhile. Frozen directions are left alone.
+ */
+static void drain_bios(struct delay_c *dc, unsigned window_ms)
+{
+	struct drain_args args = { .window_ns = (u64)window_ms * NSEC_PER_MSEC };
+	s64 count = 0;
+	int dir;
+
+	for (dir = READ; dir <= WRITE; dir++)
+		if (!READ_ONCE(dc->frozen[dir]))
+			count += atomic64_read(&dc->queue[dir].depth);
+	args.count = max_t(s64, count, 1);
+	walk_queued_bios(dc, drain_bio, &args);
+}
+
+static void last_expiry_bio(struct delay_c *dc, struct dm_delay_info *delayed,
+			    struct bio *bio, unsigned long now, u64 now_ns, void *arg)
+{
+	unsigned long *last = arg;
+
+	if (!dc->frozen[bio_data_dir(bio)] && time_after(delayed->expires, *last))
+		*last = delayed->expires;
+}
+
+/*
+ * Sleep until every bio queued now has expired and been released by the
+ * timer, but no longer than @timeout_ms. Bios mapped meanwhile are still
+ * delayed; those and frozen ones are left to the caller.
+ */
+static void wait_for_expiry(struct delay_c *dc, unsigned timeout_ms)
+{
+	unsigned long now = jiffies, last = now, deadline, limit;
+
+	walk_queued_bios(dc, last_expiry_bio, &last);
+
+	/* One more tick lets the release work run for the last ones. */
+	limit = now + msecs_to_jiffies(timeout_ms);
+	deadline = time_before(last + 1, limit) ? last + 1 : limit;
+	now = jiffies;
+	if (time_before(now, deadline))
+		schedule_timeout_uninterruptible(deadline - now);
+}
+
+/* Another target of the same name, i.e. one of another table of the device. */
+static struct delay_c *find_target(struct delay_c *dc)
+{
+	struct delay_c *other;
+
+	list_for_each_entry(other, &ddi_targets, node)
+		if (other != dc && other->md == dc->md && other->index == dc->index)
+			return other;
+	return NULL;
+}
+
+/* Called with ddi_targets_lock held, before @dc is added to ddi_targets. */
+static void set_target_name(struct delay_c *dc)
+{
+	char md_name[DM_NAME_LEN];
+	struct delay_c *other;
+
+	dc->index = 0;
+	list_for_each_entry(other, &ddi_targets, node)
+		if (other->table == dc->table)
+			dc->index++;
 
-	mutex_unlock(&dc->timer_lock);
+	if (dm_copy_name_and_uuid(dc->md, md_name, NULL))
+		strscpy(md_name, dm_device_name(dc->md), sizeof(md_name));
+	snprintf(dc->name, sizeof(dc->name), "%s:%u", md_name, dc->index);
 }
 
-static void flush_bios(struct bio *bio)
+/*
+ * Hand the config and model state of @old, the target replaced by the table
+ * holding @new, to @new. Called from the first preresume of @new; @old is
+ * suspended, so neither maps bios. Locks are still taken as elsewhere, and
+ * the read cache of @new is only freed after a grace period.
+ */
+static void take_over_state(struct delay_c *new, struct delay_c *old)
 {
-	struct bio *n;
+	struct ddi_config *cfg, *prev;
+	struct ddi_group *grp;
+	struct rcache *rc;
+	u64 pending = 0;
+	int cpu;
 
-	while (bio) {
-		n = bio->bi_next;
-		bio->bi_next = NULL;
-// https://github.com/torvalds/linux/commit/ed00aabd5eb9fb44d6aff1173234a2e911b9fead
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
-		generic_make_request(bio);
-#else
-		submit_bio_noacct(bio);
-#endif
-		bio = n;
+	cfg = kmemdup(rcu_dereference_protected(old->config, 1), sizeof(*cfg), GFP_KERNEL);
+	if (!cfg) {
+		DMWARN("Couldn't carry over state to the reloaded table");
+		return;
 	}
-}
+	mutex_lock(&new->config_lock);
+	prev = rcu_dereference_protected(new->config, lockdep_is_held(&new->config_lock));
+	cfg->generation++;
+	rcu_assign_pointer(new->config, cfg);
+	at_arm(new, cfg);
+	mutex_unlock(&new->config_lock);
+	kfree_rcu(prev, rcu);
 
-static struct bio *flush_delayed_bios(struct delay_c *dc, int flush_all)
-{
-	struct dm_delay_info *delayed, *next;
-	unsigned long next_expires = 0;
-	int start_timer = 0;
-	struct bio_list flush_bios = { };
+	for_each_possible_cpu(cpu)
+		pending += *per_cpu_ptr(old->gc_pending, cpu);
+	atomic64_set(&new->gc_written, atomic64_read(&old->gc_written) + pending);
+	atomic64_set(&new->gc_events, atomic64_read(&old->gc_events));
+	WRITE_ONCE(new->gc_until, old->gc_until);
 
-	mutex_lock(&delayed_bios_lock);
-	list_for_each_entry_safe(delayed, next, &dc->delayed_bios, list) {
-		if (flush_all || time_after_eq(jiffies, delayed->expires)) {
-			struct bio *bio = dm_bio_from_per_bio_data(delayed,
-						sizeof(struct dm_delay_info));
-			list_del(&delayed->list);
-			bio_list_add(&flush_bios, bio);
-			if ((bio_data_dir(bio) == WRITE))
-				delayed->context->writes--;
-			else
-				delayed->context->reads--;
-			continue;
-		}
+	spin_lock(&new->slc_lock);
+	new->slc_fill = old->slc_fill;
+	new->slc_updated = old->slc_updated;
+	new->slc_busy_until = old->slc_busy_until;
+	spin_unlock(&new->slc_lock);
 
-		if (!start_timer) {
-			start_timer = 1;
-			next_expires = delayed->expires;
-		} else
-			next_expires = min(next_expires, delayed->expires);
+	mutex_lock(&old->rcache_lock);
+	mutex_lock(&new->rcache_lock);
+	rc = rcu_dereference_protected(new->rcache, lockdep_is_held(&new->rcache_lock));
+	rcu_assign_pointer(new->rcache,
+			   rcu_dereference_protected(old->rcache, lockdep_is_held(&old->rcache_lock)));
+	RCU_INIT_POINTER(old->rcache, NULL);
+	new->rcache_extents = old->rcache_extents;
+	new->rcache_extent_kb = old->rcache_extent_kb;
+	mutex_unlock(&new->rcache_lock);
+	mutex_unlock(&old->rcache_lock);
+	if (rc) {
+		synchronize_rcu();
+		kvfree(rc);
 	}
 
-	mutex_unlock(&delayed_bios_lock);
+	WRITE_ONCE(new->frozen[READ], old->frozen[READ]);
+	WRITE_ONCE(new->frozen[WRITE], old->frozen[WRITE]);
 
-	if (start_timer)
-		queue_timeout(dc, next_expires);
+	atomic64_set(&new->trigger_count, atomic64_read(&old->trigger_count));
+	atomic64_set(&new->trigger_fired, atomic64_read(&old->trigger_fired));
 
-	return bio_list_get(&flush_bios);
+	/* The membership moves, so the group's count stays. */
+	mutex_lock(&ddi_groups_lock);
+	grp = rcu_dereference_protected(old->group, lockdep_is_held(&ddi_groups_lock));
+	rcu_assign_pointer(new->group, grp);
+	RCU_INIT_POINTER(old->group, NULL);
+	mutex_unlock(&ddi_groups_lock);
 }
 
-static void flush_expired_bios(struct work_struct *work)
+/*
+ * Allocate rings of @pages data pages per CPU unless the current ones already
+ * have that size. Called with record_lock held.
+ */
+static int ring_setup(struct delay_c *dc, unsigned pages)
 {
-	struct delay_c *dc;
+	struct ddi_ring *old, *new;
 
-	dc = container_of(work, struct delay_c, flush_expired_bios);
-	flush_bios(flush_delayed_bios(dc, 0));
+	old = rcu_dereference_protected(dc->ring, lockdep_is_held(&dc->record_lock));
+	if (old && old->stride == DDI_RING_HEADER_SIZE + (size_t)pages * PAGE_SIZE)
+		return 0;
+
+	new = ring_alloc(pages);
+	if (!new)
+		return -ENOMEM;
+
+	rcu_assign_pointer(dc->ring, new);
+	if (old) {
+		synchronize_rcu();
+		ring_free(old);
+	}
+	return 0;
 }
 
 /*
@@ -246,9 +3209,10 @@ static void flush_expired_bios(struct work_struct *work)
 static int delay_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
 	struct delay_c *dc;
+	struct ddi_config *cfg;
 	unsigned long long tmpll;
 	char dummy;
-	int ret;
+	int ret, class, level, op;
 
 	if (argc != 3 && argc != 6) {
 		ti->error = "Requires exactly 3 or 6 arguments";
@@ -256,12 +3220,52 @@ static int delay_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 
 	dc = kmalloc(sizeof(*dc), GFP_KERNEL);
-	if (!dc) {
+	cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!dc || !cfg) {
+		kfree(dc);
+		kfree(cfg);
 		ti->error = "Cannot allocate context";
 		return -ENOMEM;
 	}
+	cfg->generation = 1;
+	RCU_INIT_POINTER(dc->config, cfg);
+	mutex_init(&dc->config_lock);
+	RCU_INIT_POINTER(dc->group, NULL);
+	dc->batch = NULL;
+	dc->batch_owner = NULL;
 
-	dc->reads = dc->writes = 0;
+	memset(dc->queue, 0, sizeof(dc->queue));
+	dc->epoch = ktime_get_ns();
+	atomic64_set(&dc->timer_fires, 0);
+	atomic64_set(&dc->work_runs, 0);
+	atomic64_set(&dc->work_bios, 0);
+	atomic64_set(&dc->work_max_bios, 0);
+	dc->frozen[READ] = dc->frozen[WRITE] = false;
+	atomic64_set(&dc->trigger_count, 0);
+	atomic64_set(&dc->trigger_fired, 0);
+	dc->trigger_fired_ns = 0;
+	for (op = 0; op < DDI_NR_OPS; op++) {
+		atomic_set(&dc->oneshot_left[op], 0);
+		dc->oneshot_delay[op] = 0;
+	}
+	atomic64_set(&dc->gc_written, 0);
+	atomic64_set(&dc->gc_events, 0);
+	dc->gc_until = jiffies;
+	spin_lock_init(&dc->slc_lock);
+	dc->slc_fill = 0;
+	dc->slc_updated = dc->slc_busy_until = ktime_get_ns();
+	RCU_INIT_POINTER(dc->rcache, NULL);
+	mutex_init(&dc->rcache_lock);
+	dc->rcache_extents = 0;
+	dc->rcache_extent_kb = DDI_RCACHE_DEFAULT_EXTENT_KB;
+	dc->record = 0;
+	dc->cost_accounting = 0;
+	dc->record_pages = DDI_RECORD_DEFAULT_PAGES;
+	RCU_INIT_POINTER(dc->ring, NULL);
+	mutex_init(&dc->record_lock);
+	for (class = 0; class < DDI_IOPRIO_CLASSES; class++)
+		for (level = 0; level < DDI_IOPRIO_LEVELS; level++)
+			cfg->ioprio_delay[class][level] = DDI_IOPRIO_INHERIT;
 
 	ret = -EINVAL;
 	if (sscanf(argv[1], "%llu%c", &tmpll, &dummy) != 1) {
@@ -270,7 +3274,7 @@ static int delay_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 	dc->start_read = tmpll;
 
-	if (sscanf(argv[2], "%u%c", &dc->read_delay, &dummy) != 1) {
+	if (sscanf(argv[2], "%u%c", &cfg->read_delay, &dummy) != 1) {
 		ti->error = "Invalid delay";
 		goto bad;
 	}
@@ -293,7 +3297,7 @@ static int delay_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 	dc->start_write = tmpll;
 
-	if (sscanf(argv[5], "%u%c", &dc->write_delay, &dummy) != 1) {
+	if (sscanf(argv[5], "%u%c", &cfg->write_delay, &dummy) != 1) {
 		ti->error = "Invalid write delay";
 		goto bad_dev_read;
 	}
@@ -313,13 +3317,23 @@ out:
 		goto bad_queue;
 	}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-	setup_timer(&dc->delay_timer, handle_delayed_timer, (unsigned long)dc);
-#else
+	dc->gc_pending = alloc_percpu(u64);
+	dc->rcache_stats = alloc_percpu(struct rcache_stats);
+	dc->latency = alloc_percpu(struct latency_hists);
+	dc->stats = alloc_percpu(struct io_stats);
+	dc->cost = alloc_percpu(struct cpu_cost);
+	if (!dc->gc_pending || !dc->rcache_stats || !dc->latency || !dc->stats || !dc->cost) {
+		DMERR("Couldn't allocate per-cpu counters");
+		ret = -ENOMEM;
+		goto bad_percpu;
+	}
+
 	timer_setup(&dc->delay_timer, handle_delayed_timer, 0);
-#endif
 
 	INIT_WORK(&dc->flush_expired_bios, flush_expired_bios);
+	INIT_WORK(&dc->trigger_work, trigger_apply);
+	at_timer_init(dc, CLOCK_REALTIME);
+	dc->at_done = false;
 	INIT_LIST_HEAD(&dc->delayed_bios);
 	mutex_init(&dc->timer_lock);
 	atomic_set(&dc->may_delay, 1);
@@ -328,16 +3342,42 @@ out:
 	ti->num_discard_bios = 1;
 	ti->per_io_data_size = sizeof(struct dm_delay_info);
 	ti->private = dc;
+	dc->md = dm_table_get_md(ti->table);
+	dc->devt = disk_devt(dm_disk(dc->md));
+	dc->table = ti->table;
+	dc->len = ti->len;
+	dc->kobj = NULL;
+	dc->debugfs_dir = NULL;
+	dc->resumed = false;
+	init_dev_attrs(dc);
 
-	ret = init_dev_kobject(dc);
-	if (ret) {
-		DMERR("Failed to setup sysfs");
-		goto bad_sysfs;
+	/*
+	 * A table loaded to replace a live one would clash with its sysfs and
+	 * debugfs names. They are handed over on its first resume.
+	 */
+	mutex_lock(&ddi_targets_lock);
+	set_target_name(dc);
+	if (!find_target(dc)) {
+		ret = init_dev_kobject(dc);
+		if (ret) {
+			mutex_unlock(&ddi_targets_lock);
+			DMERR("Failed to setup sysfs");
+			goto bad_sysfs;
+		}
+		init_dev_debugfs(dc);
 	}
+	list_add_tail(&dc->node, &ddi_targets);
+	mutex_unlock(&ddi_targets_lock);
 
 	return 0;
 
 bad_sysfs:
+bad_percpu:
+	free_percpu(dc->cost);
+	free_percpu(dc->stats);
+	free_percpu(dc->latency);
+	free_percpu(dc->rcache_stats);
+	free_percpu(dc->gc_pending);
 	destroy_workqueue(dc->kdelayd_wq);
 bad_queue:
 	if (dc->dev_write)
@@ -345,6 +3385,7 @@ bad_queue:
 bad_dev_read:
 	dm_put_device(ti, dc->dev_read);
 bad:
+	kfree(cfg);
 	kfree(dc);
 	return ret;
 }
@@ -353,10 +3394,29 @@ static void delay_dtr(struct dm_target *ti)
 {
 	struct delay_c *dc = ti->private;
 
+	mutex_lock(&ddi_targets_lock);
+	list_del(&dc->node);
+	mutex_unlock(&ddi_targets_lock);
+	destroy_dev_debugfs(dc);
 	destroy_dev_kobject(dc);
+	group_leave(dc);
+
+	/* With the sysfs files gone, no store can arm the timer again. */
+	hrtimer_cancel(&dc->at_timer);
 
 	if (dc->kdelayd_wq)
 		destroy_workqueue(dc->kdelayd_wq);
+	/* trigger_apply() may have re-armed it after presuspend, even while draining. */
+	del_timer_sync(&dc->delay_timer);
+
+	free_percpu(dc->cost);
+	free_percpu(dc->stats);
+	free_percpu(dc->latency);
+	free_percpu(dc->rcache_stats);
+	free_percpu(dc->gc_pending);
+	kvfree(rcu_dereference_protected(dc->rcache, 1));
+	ring_free(rcu_dereference_protected(dc->ring, 1));
+	kfree(rcu_dereference_protected(dc->config, 1));
 
 	dm_put_device(ti, dc->dev_read);
 
@@ -366,31 +3426,55 @@ static void delay_dtr(struct dm_target *ti)
 	kfree(dc);
 }
 
-static int delay_bio(struct delay_c *dc, int delay, struct bio *bio)
+/* @offset is the bio's sector within the target, which events and records report. */
+static int delay_bio(struct delay_c *dc, int delay, enum ddi_base base, struct bio *bio,
+		     sector_t offset, u64 *cost)
 {
 	struct dm_delay_info *delayed;
 	unsigned long expires = 0;
+	int dir = bio_data_dir(bio);
+	enum ddi_op op = bio_ddi_op(bio);
+
+	/* Timestamps are kept for every bio so that delay_end_io() can split its latency. */
+	delayed = dm_per_bio_data(bio, sizeof(struct dm_delay_info));
+	delayed->context = dc;
+	delayed->base = base;
+	delayed->queued = ktime_get_ns();
+	delayed->sector = offset;
+	delayed->bytes = bio_bytes(bio);
+	delayed->pid = current->pid;
 
-	if (!delay || !atomic_read(&dc->may_delay))
+	stats_account(dc->stats, op, DDI_STAT_SUBMITTED, delayed->bytes);
+
+	if (!atomic_read(&dc->may_delay) ||
+	    (!delay && !READ_ONCE(dc->frozen[dir]))) {
+		stats_account(dc->stats, op, DDI_STAT_PASSTHROUGH, delayed->bytes);
+		delayed->delay = 0;
+		delayed->dispatched = delayed->queued;
+		hist_record(&dc->latency->delay[dir], 0);
+		hist_record(&dc->latency->hold[dir], 0);
+		trace_ddi_enqueue(dc->devt, delayed->sector, delayed->bytes, bio_op(bio),
+				  0, 0, queue_depth(dc));
 		return DM_MAPIO_REMAPPED;
+	}
 
-	delayed = dm_per_bio_data(bio, sizeof(struct dm_delay_info));
+	stats_account(dc->stats, op, DDI_STAT_DELAYED, delayed->bytes);
+	hist_record(&dc->latency->delay[dir], (u64)delay * NSEC_PER_MSEC);
 
-	delayed->context = dc;
+	delayed->delay = delay;
 	delayed->expires = expires = jiffies + msecs_to_jiffies(delay);
+	delayed->expires_ns = delayed->queued + (u64)delay * NSEC_PER_MSEC;
 
-	mutex_lock(&delayed_bios_lock);
-
-	if (bio_data_dir(bio) == WRITE)
-		dc->writes++;
-	else
-		dc->reads++;
+	gauge_enqueue(dc, dir, delayed);
 
+	cost_lock(&delayed_bios_lock, cost);
 	list_add_tail(&delayed->list, &dc->delayed_bios);
+	trace_ddi_enqueue(dc->devt, delayed->sector, delayed->bytes, bio_op(bio),
+			  delay, 0, queue_depth(dc));
 
 	mutex_unlock(&delayed_bios_lock);
 
-	queue_timeout(dc, expires);
+	__queue_timeout(dc, expires, cost);
 
 	return DM_MAPIO_SUBMITTED;
 }
@@ -398,10 +3482,56 @@ static int delay_bio(struct delay_c *dc, int delay, struct bio *bio)
 static void delay_presuspend(struct dm_target *ti)
 {
 	struct delay_c *dc = ti->private;
+	unsigned wait = config_read(dc, suspend_wait);
+
+	if (wait)
+		wait_for_expiry(dc, wait);
 
 	atomic_set(&dc->may_delay, 0);
 	del_timer_sync(&dc->delay_timer);
-	flush_bios(flush_delayed_bios(dc, 1));
+	flush_bios(flush_delayed_bios(dc, 1, NULL));
+}
+
+/*
+ * On the first resume of a table loaded in place of another, before any
+ * bio is mapped, take over the sysfs and debugfs names of the replaced
+ * target and, if it was live and has reload_keep, its config and state.
+ * The replaced target is suspended and only waits to be destroyed. Any
+ * resume of a target still without sysfs, e.g. because its ctr found a
+ * table since destroyed, creates its names.
+ */
+static int delay_preresume(struct dm_target *ti)
+{
+	struct delay_c *dc = ti->private;
+	struct delay_c *old = NULL;
+
+	mutex_lock(&ddi_targets_lock);
+	if (!dc->resumed)
+		old = find_target(dc);
+	if (old) {
+		destroy_dev_debugfs(old);
+		destroy_dev_kobject(old);
+		old->debugfs_dir = NULL;
+		old->kobj = NULL;
+	}
+	if (old && old->resumed) {
+		hrtimer_cancel(&old->at_timer);
+		flush_work(&old->trigger_work);
+
+		if (config_read(old, reload_keep))
+			take_over_state(dc, old);
+	}
+	dc->resumed = true;
+
+	if (!dc->kobj) {
+		if (init_dev_kobject(dc))
+			DMWARN("Failed to setup sysfs of the reloaded table");
+		if (!dc->debugfs_dir)
+			init_dev_debugfs(dc);
+	}
+	mutex_unlock(&ddi_targets_lock);
+
+	return 0;
 }
 
 static void delay_resume(struct dm_target *ti)
@@ -411,66 +3541,634 @@ static void delay_resume(struct dm_target *ti)
 	atomic_set(&dc->may_delay, 1);
 }
 
+/* Returns the delay overriding @delay for the I/O priority of @bio, if any. */
+static int ioprio_delay(struct ddi_config *cfg, struct bio *bio, int delay,
+			enum ddi_base *base)
+{
+	unsigned short ioprio = bio->bi_ioprio;
+	int class = IOPRIO_PRIO_CLASS(ioprio);
+	int level = IOPRIO_PRIO_DATA(ioprio) & (DDI_IOPRIO_LEVELS - 1);
+	int override;
+
+	if (class >= DDI_IOPRIO_CLASSES)
+		return delay;
+
+	override = cfg->ioprio_delay[class][level];
+	if (override == DDI_IOPRIO_INHERIT)
+		return delay;
+	*base = DDI_BASE_NONE;
+	return override;
+}
+
+static bool trigger_hit(struct delay_c *dc, struct ddi_config *cfg, struct bio *bio,
+			sector_t offset)
+{
+	struct ddi_trigger *t = &cfg->trigger;
+
+	switch (t->type) {
+	case DDI_TRIGGER_BYTES_WRITTEN:
+		return bio_data_dir(bio) == WRITE && bio_sectors(bio) &&
+			atomic64_add_return(bio_bytes(bio), &dc->trigger_count) >= t->arg[0];
+	case DDI_TRIGGER_FLUSH:
+		return (bio_op(bio) == REQ_OP_FLUSH || (bio->bi_opf & REQ_PREFLUSH)) &&
+			atomic64_inc_return(&dc->trigger_count) >= t->arg[0];
+	case DDI_TRIGGER_SECTOR:
+		return bio_sectors(bio) && offset < t->arg[0] + t->arg[1] &&
+			offset + bio_sectors(bio) > t->arg[0];
+	case DDI_TRIGGER_TIME:
+		return ktime_get_ns() - dc->epoch >= t->arg[0] * NSEC_PER_MSEC;
+	case DDI_TRIGGER_AT:
+		/* Normally at_timer fires first; this covers bios racing with it. */
+		return at_clock_ns(at_clocks[t->arg[0]]) + cfg->clock_offset >= t->arg[1];
+	}
+	return false;
+}
+
+/*
+ * Returns the base delay of the trigger profile for @dir once the armed
+ * trigger has fired, or @delay. @offset is the bio's sector in the target.
+ */
+static int trigger_delay(struct delay_c *dc, struct ddi_config *cfg, struct bio *bio,
+			 sector_t offset, int dir, int delay, enum ddi_base *base)
+{
+	struct ddi_trigger *t = &cfg->trigger;
+
+	if (atomic64_read(&dc->trigger_fired) != t->seq) {
+		if (!trigger_hit(dc, cfg, bio, offset))
+			return delay;
+		trigger_fire(dc, t->seq);
+	}
+	if (t->delay[dir] < 0 || *base == DDI_BASE_GROUP)
+		return delay;
+	*base = DDI_BASE_NONE;
+	return t->delay[dir];
+}
+
+/* Returns the one-shot delay of @bio if the budget of its type is not used up. */
+static int oneshot_delay(struct delay_c *dc, struct bio *bio, int delay, enum ddi_base *base)
+{
+	enum ddi_op op = bio_ddi_op(bio);
+
+	if (atomic_read(&dc->oneshot_left[op]) <= 0 ||
+	    atomic_dec_if_positive(&dc->oneshot_left[op]) < 0)
+		return delay;
+	*base = DDI_BASE_NONE;
+	return READ_ONCE(dc->oneshot_delay[op]);
+}
+
+/*
+ * Make the profile of a fired trigger the regular delays and disarm it.
+ * Bios queued before it fired follow the change as their delay_retime says.
+ */
+static void trigger_apply(struct work_struct *work)
+{
+	struct delay_c *dc = container_of(work, struct delay_c, trigger_work);
+	struct ddi_config *cfg;
+	unsigned old_delay[2], new_delay[2];
+	int dir;
+
+	cfg = config_edit(dc);
+	if (!cfg)
+		return;
+	if (cfg->trigger.type == DDI_TRIGGER_NONE ||
+	    cfg->trigger.seq != atomic64_read(&dc->trigger_fired)) {
+		config_abort(dc, cfg);
+		return;
+	}
+	old_delay[READ] = cfg->read_delay;
+	old_delay[WRITE] = cfg->write_delay;
+	if (cfg->trigger.delay[READ] >= 0)
+		cfg->read_delay = cfg->trigger.delay[READ];
+	if (cfg->trigger.delay[WRITE] >= 0)
+		cfg->write_delay = cfg->trigger.delay[WRITE];
+	new_delay[READ] = cfg->read_delay;
+	new_delay[WRITE] = cfg->write_delay;
+	cfg->trigger.type = DDI_TRIGGER_NONE;
+	config_commit(dc, cfg);
+
+	for (dir = READ; dir <= WRITE; dir++)
+		if (new_delay[dir] != old_delay[dir])
+			delay_changed(dc, dir, old_delay[dir], new_delay[dir],
+				      config_read(dc, delay_retime));
+}
+
+static u32 random_below(u32 ceil)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0)
+	return prandom_u32_max(ceil);
+#else
+	return get_random_u32_below(ceil);
+#endif
+}
+
+static void gc_start(struct delay_c *dc, struct ddi_config *cfg)
+{
+	int pause = cfg->gc_pause;
+	unsigned jitter = cfg->gc_jitter;
+	unsigned long until;
+
+	if (jitter)
+		pause += (int)random_below(2 * jitter + 1) - (int)jitter;
+	until = jiffies + msecs_to_jiffies(max(pause, 0));
+
+	/* Overlapping collections extend the stall, never shorten it. */
+	if (time_after(until, READ_ONCE(dc->gc_until)))
+		WRITE_ONCE(dc->gc_until, until);
+	atomic64_inc(&dc->gc_events);
+}
+
+/*
+ * Count written bytes per CPU and fold them into gc_written in batches, so
+ * the shared counter is only touched once every DDI_GC_BATCH bytes per CPU.
+ * A collection starts whenever the folded total crosses an interval boundary.
+ */
+static void gc_account_write(struct delay_c *dc, struct ddi_config *cfg, unsigned bytes)
+{
+	u64 interval = (u64)cfg->gc_interval_mb << 20;
+	u64 pending, total;
+
+	pending = this_cpu_add_return(*dc->gc_pending, bytes);
+	if (pending < DDI_GC_BATCH)
+		return;
+
+	pending = this_cpu_xchg(*dc->gc_pending, 0);
+	total = atomic64_add_return(pending, &dc->gc_written);
+	if (div64_u64(total - pending, interval) != div64_u64(total, interval))
+		gc_start(dc, cfg);
+}
+
+/* Returns @delay extended by the remaining time of an ongoing collection. */
+static int gc_delay(struct delay_c *dc, struct ddi_config *cfg, struct bio *bio, int delay)
+{
+	unsigned long until, now;
+
+	if (!cfg->gc_interval_mb)
+		return delay;
+
+	if (bio_data_dir(bio) == WRITE) {
+		if (bio_sectors(bio))
+			gc_account_write(dc, cfg, bio_bytes(bio));
+	} else if (!cfg->gc_stall_reads) {
+		return delay;
+	}
+
+	until = READ_ONCE(dc->gc_until);
+	now = jiffies;
+	if (time_before(now, until))
+		delay += jiffies_to_msecs(until - now);
+
+	return delay;
+}
+
+/* Drain the SLC cache for the time elapsed since the last update. */
+static void slc_drain(struct delay_c *dc, struct ddi_config *cfg, u64 now)
+{
+	u64 capacity = (u64)cfg->slc_capacity_mb << 20;
+	u64 elapsed_us, drained, mb_us;
+	u32 rem;
+
+	/* now may be sampled before a concurrent writer took the lock. */
+	if (now <= dc->slc_updated)
+		return;
+	elapsed_us = div_u64(now - dc->slc_updated, NSEC_PER_USEC);
+	dc->slc_updated = now;
+
+	/* MiB/s times microseconds; elapsed time is capped to keep it in 64 bits. */
+	mb_us = min_t(u64, elapsed_us, U32_MAX) * cfg->slc_drain_rate;
+	drained = div_u64_rem(mb_us, USEC_PER_SEC, &rem) << 20;
+	drained += div_u64((u64)rem << 20, USEC_PER_SEC);
+
+	dc->slc_fill = dc->slc_fill > drained ? dc->slc_fill - drained : 0;
+	dc->slc_fill = min(dc->slc_fill, capacity);
+}
+
+static u64 slc_current_fill(struct delay_c *dc)
+{
+	u64 fill;
+
+	rcu_read_lock();
+	spin_lock(&dc->slc_lock);
+	slc_drain(dc, rcu_dereference(dc->config), ktime_get_ns());
+	fill = dc->slc_fill;
+	spin_unlock(&dc->slc_lock);
+	rcu_read_unlock();
+
+	return fill;
+}
+
+/* Returns @delay extended by the SLC cache model for writes. */
+static int slc_delay(struct delay_c *dc, struct ddi_config *cfg, struct bio *bio, int delay)
+{
+	u64 capacity = (u64)cfg->slc_capacity_mb << 20;
+	unsigned bytes = bio_bytes(bio);
+	unsigned bw;
+	u64 now, wait;
+
+	if (!capacity || bio_op(bio) != REQ_OP_WRITE || !bytes)
+		return delay;
+
+	now = ktime_get_ns();
+	spin_lock(&dc->slc_lock);
+	slc_drain(dc, cfg, now);
+
+	if (dc->slc_fill + bytes <= capacity) {
+		dc->slc_fill += bytes;
+		spin_unlock(&dc->slc_lock);
+		return delay + min_t(u64, cfg->slc_fast_delay, INT_MAX - delay);
+	}
+
+	/*
+	 * Cache exhausted: writes are serialized at the native bandwidth, so
+	 * each one waits for every slow write queued before it.
+	 */
+	dc->slc_fill = capacity;
+	wait = cfg->slc_slow_delay;
+	bw = cfg->slc_slow_bw;
+	if (bw) {
+		dc->slc_busy_until = max(dc->slc_busy_until, now) +
+			div64_u64((u64)bytes * NSEC_PER_SEC, (u64)bw << 10);
+		wait += div_u64(dc->slc_busy_until - now, NSEC_PER_MSEC);
+	}
+	spin_unlock(&dc->slc_lock);
+
+	/* The backlog of a low bandwidth under sustained writes has no bound. */
+	return delay + min_t(u64, wait, INT_MAX - delay);
+}
+
+/*
+ * Replace the read cache tracker with an empty one of the given geometry, or
+ * remove it if @extents is 0. Called with rcache_lock held.
+ */
+static int rcache_rebuild(struct delay_c *dc, unsigned extents, unsigned extent_kb)
+{
+	struct rcache *new = NULL, *old;
+	unsigned sets;
+
+	if (extents) {
+		/* hash_64() needs at least one bit. */
+		sets = roundup_pow_of_two(max_t(unsigned, DIV_ROUND_UP(extents, DDI_RCACHE_WAYS), 2));
+		new = kvzalloc(sizeof(*new) + sets * sizeof(struct rcache_set), GFP_KERNEL);
+		if (!new)
+			return -ENOMEM;
+		/* extent_kb KiB in 512 byte sectors. */
+		new->extent_shift = ilog2(extent_kb) + 1;
+		new->set_bits = ilog2(sets);
+	}
+
+	old = rcu_dereference_protected(dc->rcache, lockdep_is_held(&dc->rcache_lock));
+	rcu_assign_pointer(dc->rcache, new);
+	WRITE_ONCE(dc->rcache_extents, extents);
+	WRITE_ONCE(dc->rcache_extent_kb, extent_kb);
+
+	if (old) {
+		synchronize_rcu();
+		kvfree(old);
+	}
+	return 0;
+}
+
+/*
+ * Look up an extent and insert it on a miss. Concurrent updates of a set are
+ * not serialized; a lost update only makes the emulated cache less precise.
+ */
+static bool rcache_touch(struct rcache *rc, u64 extent)
+{
+	struct rcache_set *set = &rc->sets[hash_64(extent, rc->set_bits)];
+	u64 tag = extent + 1;
+	unsigned way, hand, i;
+	u8 refs;
+
+	for (way = 0; way < DDI_RCACHE_WAYS; way++) {
+		if (READ_ONCE(set->tags[way]) == tag) {
+			if (!(READ_ONCE(set->refs) & (1 << way)))
+				WRITE_ONCE(set->refs, set->refs | (1 << way));
+			return true;
+		}
+	}
+
+	/* CLOCK: skip and clear referenced ways, evict the first unreferenced. */
+	refs = READ_ONCE(set->refs);
+	hand = READ_ONCE(set->hand) % DDI_RCACHE_WAYS;
+	for (i = 0; i < DDI_RCACHE_WAYS && (refs & (1 << hand)); i++) {
+		refs &= ~(1 << hand);
+		hand = (hand + 1) % DDI_RCACHE_WAYS;
+	}
+	WRITE_ONCE(set->tags[hand], tag);
+	WRITE_ONCE(set->refs, refs);
+	WRITE_ONCE(set->hand, (hand + 1) % DDI_RCACHE_WAYS);
+
+	return false;
+}
+
+/*
+ * Track extents touched by reads and writes, keyed on @offset, the bio's
+ * sector in the target, so that reads and writes share extents even with a
+ * separate write device. Returns the hit delay for reads whose extents are
+ * all cached, @delay otherwise.
+ */
+static int rcache_delay(struct delay_c *dc, struct ddi_config *cfg, struct bio *bio,
+			sector_t offset, int delay, enum ddi_base *base)
+{
+	struct rcache *rc;
+	struct rcache_stats *stats;
+	u64 extent, last;
+	bool read = bio_op(bio) == REQ_OP_READ;
+	bool hit = true;
+
+	if (!rcu_access_pointer(dc->rcache) || !bio_sectors(bio))
+		return delay;
+	if (!read && bio_op(bio) != REQ_OP_WRITE)
+		return delay;
+
+	rcu_read_lock();
+	rc = rcu_dereference(dc->rcache);
+	if (!rc) {
+		rcu_read_unlock();
+		return delay;
+	}
+	last = (offset + bio_sectors(bio) - 1) >> rc->extent_shift;
+	for (extent = offset >> rc->extent_shift; extent <= last; extent++)
+		hit &= rcache_touch(rc, extent);
+	rcu_read_unlock();
+
+	if (!read)
+		return delay;
+
+	stats = get_cpu_ptr(dc->rcache_stats);
+	if (hit)
+		stats->hits++;
+	else
+		stats->misses++;
+	put_cpu_ptr(dc->rcache_stats);
+
+	if (!hit)
+		return delay;
+	*base = DDI_BASE_NONE;
+	return cfg->rcache_hit_delay;
+}
+
 static int delay_map(struct dm_target *ti, struct bio *bio)
 {
 	struct delay_c *dc = ti->private;
-	int delay;
+	struct ddi_config *cfg;
+	struct ddi_group *grp;
+	enum ddi_base base = DDI_BASE_OWN;
+	int delay, ret;
 	struct block_device *bdev;
-	sector_t sector;
+	sector_t sector, offset;
+	u64 start = cost_start(dc);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-	sector = bio->bi_sector;
-#else
 	sector = bio->bi_iter.bi_sector;
-#endif
 
+	/* Every tunable is taken from the same config for a consistent decision. */
+	rcu_read_lock();
+	cfg = rcu_dereference(dc->config);
+
+	offset = dm_target_offset(ti, sector);
 	if ((bio_data_dir(bio) == WRITE) && (dc->dev_write)) {
-		delay = dc->write_delay;
+		delay = cfg->write_delay;
 		bdev = dc->dev_write->bdev;
-		sector = dc->start_write + dm_target_offset(ti, sector);
+		sector = dc->start_write + offset;
 	} else {
-		delay = dc->read_delay;
+		delay = cfg->read_delay;
 		bdev = dc->dev_read->bdev;
-		sector = dc->start_read + dm_target_offset(ti, sector);
+		sector = dc->start_read + offset;
 	}
+	grp = rcu_dereference(dc->group);
+	if (grp) {
+		int group_delay = rcu_dereference(grp->config)->delay[delay_dir(dc, bio)];
+
+		if (group_delay >= 0) {
+			delay = group_delay;
+			base = DDI_BASE_GROUP;
+		}
+	}
+	if (cfg->trigger.type != DDI_TRIGGER_NONE)
+		delay = trigger_delay(dc, cfg, bio, offset, delay_dir(dc, bio), delay, &base);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-	bio->bi_bdev = bdev;
-#else
 	bio_set_dev(bio, bdev);
-#endif
 
-	if (bio_sectors(bio)) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-		bio->bi_sector = sector;
-#else
+	if (bio_sectors(bio))
 		bio->bi_iter.bi_sector = sector;
+
+	delay = ioprio_delay(cfg, bio, delay, &base);
+	delay = rcache_delay(dc, cfg, bio, offset, delay, &base);
+	delay = gc_delay(dc, cfg, bio, delay);
+	delay = slc_delay(dc, cfg, bio, delay);
+	rcu_read_unlock();
+	delay = oneshot_delay(dc, bio, delay, &base);
+
+	ret = delay_bio(dc, delay, base, bio, offset, &start);
+	cost_end(dc, DDI_COST_MAP, start, 1);
+	return ret;
+}
+
+static int delay_end_io(struct dm_target *ti, struct bio *bio, blk_status_t *error)
+{
+	struct delay_c *dc = ti->private;
+	struct dm_delay_info *delayed = dm_per_bio_data(bio, sizeof(struct dm_delay_info));
+	int dir = bio_data_dir(bio);
+	u64 now = ktime_get_ns();
+	u64 held = delayed->dispatched - delayed->queued;
+	u64 delay = (u64)delayed->delay * NSEC_PER_MSEC;
+	int err;
+
+	hist_record(&dc->latency->completed_delay[dir], delay);
+	hist_record(&dc->latency->queue[dir], held > delay ? held - delay : 0);
+	hist_record(&dc->latency->service[dir], now - delayed->dispatched);
+
+	err = blk_status_to_errno(*error);
+	trace_ddi_complete(dc->devt, delayed->sector, delayed->bytes, bio_op(bio),
+			   delayed->delay, held, now - delayed->dispatched, err);
+
+	if (READ_ONCE(dc->record)) {
+		struct ddi_record rec = {
+			.queued_ns	= delayed->queued,
+			.dispatched_ns	= delayed->dispatched,
+			.completed_ns	= now,
+			.sector		= delayed->sector,
+			.bytes		= delayed->bytes,
+			.delay_ms	= delayed->delay,
+			.opf		= bio->bi_opf,
+			.pid		= delayed->pid,
+			.error		= err,
+			.op		= bio_ddi_op(bio),
+			.dir		= dir,
+		};
+		struct ddi_ring *ring;
+
+		rcu_read_lock();
+		ring = rcu_dereference(dc->ring);
+		if (ring)
+			ring_write(ring, &rec);
+		rcu_read_unlock();
+	}
+
+	return DM_ENDIO_DONE;
+}
+
+/* Sysfs files cleared by the "reset" message. */
+static const char *const reset_attr_names[] = {
+	"latency_histogram", "completion_histogram", "dispatch", "queue_reset", "cpu_cost",
+};
+
+static int message_dir(const char *str)
+{
+	if (!strcmp(str, "read"))
+		return READ;
+	if (!strcmp(str, "write"))
+		return WRITE;
+	return -1;
+}
+
+/*
+ * Messages:
+ *   set <name> <value> [<name> <value>]... - write tunable sysfs files; all
+ *                                            names are checked before any is
+ *                                            written and they change in one
+ *                                            config
+ *   reset                                  - clear histograms and counters
+ *   freeze <read|write>
+ *   thaw <read|write>
+ *   drain [<window_ms>]                    - release every held bio, now or
+ *                                            spread over window_ms
+ *   rcache <extents> <extent_kb>           - rebuild the read cache, as the
+ *                                            sysfs files of both would
+ *   oneshot <op> <bios> <delay>            - as the oneshot sysfs file
+ *
+ * Values with spaces, e.g. for ioprio_delay, have them escaped with '\'.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+static int delay_message(struct dm_target *ti, unsigned argc, char **argv)
+#else
+static int delay_message(struct dm_target *ti, unsigned argc, char **argv,
+			 char *result, unsigned maxlen)
 #endif
+{
+	struct delay_c *dc = ti->private;
+	struct kobj_attribute *attr;
+	ssize_t ret;
+	int i, dir;
+
+	if (!argc)
+		goto bad;
+
+	if (!strcasecmp(argv[0], "set")) {
+		if (argc < 3 || !(argc & 1))
+			goto bad;
+		for (i = 1; i < argc; i += 2) {
+			if (!find_config_attr(dc, argv[i])) {
+				DMWARN("Unknown or not a tunable: %s", argv[i]);
+				return -EINVAL;
+			}
+		}
+		/* Config changes are published together, or not at all on error. */
+		ret = config_batch_begin(dc);
+		if (ret)
+			return ret;
+		for (i = 1; i < argc; i += 2) {
+			attr = find_config_attr(dc, argv[i]);
+			ret = attr->store(dc->kobj, attr, argv[i + 1], strlen(argv[i + 1]));
+			if (ret < 0) {
+				DMWARN("Failed to set %s to %s", argv[i], argv[i + 1]);
+				break;
+			}
+		}
+		config_batch_end(dc, ret >= 0);
+		return ret < 0 ? ret : 0;
+	}
+
+	if (!strcasecmp(argv[0], "reset") && argc == 1) {
+		for (i = 0; i < ARRAY_SIZE(reset_attr_names); i++) {
+			attr = find_dev_attr(dc, reset_attr_names[i]);
+			attr->store(dc->kobj, attr, "1", 1);
+		}
+		return 0;
+	}
+
+	if ((!strcasecmp(argv[0], "freeze") || !strcasecmp(argv[0], "thaw")) && argc == 2) {
+		dir = message_dir(argv[1]);
+		if (dir < 0)
+			goto bad;
+		if (!strcasecmp(argv[0], "freeze"))
+			freeze_bios(dc, dir);
+		else
+			thaw_bios(dc, dir);
+		return 0;
+	}
+
+	if (!strcasecmp(argv[0], "drain") && argc <= 2) {
+		unsigned window = 0;
+
+		if (argc == 2 && kstrtouint(argv[1], 10, &window))
+			goto bad;
+		drain_bios(dc, window);
+		return 0;
+	}
+
+	/* Not part of the config, so they cannot be staged by "set". */
+	if (!strcasecmp(argv[0], "rcache") && argc == 3) {
+		unsigned extents, extent_kb;
+
+		if (kstrtouint(argv[1], 10, &extents) || extents > DDI_RCACHE_MAX_EXTENTS ||
+		    kstrtouint(argv[2], 10, &extent_kb) || !is_power_of_2(extent_kb))
+			goto bad;
+		mutex_lock(&dc->rcache_lock);
+		ret = rcache_rebuild(dc, extents, extent_kb);
+		mutex_unlock(&dc->rcache_lock);
+		return ret;
 	}
 
+	if (!strcasecmp(argv[0], "oneshot") && argc == 4) {
+		unsigned bios, delay;
+		int op = find_ddi_op(argv[1]);
+
+		if (op < 0 || kstrtouint(argv[2], 10, &bios) || bios > INT_MAX ||
+		    kstrtouint(argv[3], 10, &delay))
+			goto bad;
+		oneshot_arm(dc, op, bios, delay);
+		return 0;
+	}
 
-	return delay_bio(dc, delay, bio);
+bad:
+	DMWARN("Unrecognised message received");
+	return -EINVAL;
 }
 
 static void delay_status(struct dm_target *ti, status_type_t type,
 			 unsigned status_flags, char *result, unsigned maxlen)
 {
 	struct delay_c *dc = ti->private;
-	int sz = 0;
+	struct ddi_config *cfg;
+	struct io_stats sum;
+	int sz = 0, op, stat;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		DMEMIT("%u %u", dc->reads, dc->writes);
+		DMEMIT("%lld %lld %llu", atomic64_read(&dc->queue[READ].depth),
+		       atomic64_read(&dc->queue[WRITE].depth),
+		       (unsigned long long)atomic64_read(&dc->gc_events));
+
+		/* Same order as the stats sysfs attribute, without the op names. */
+		stats_sum(dc->stats, &sum);
+		for (op = 0; op < DDI_NR_OPS; op++)
+			for (stat = 0; stat < DDI_NR_STATS; stat++)
+				DMEMIT(" %llu %llu", (unsigned long long)sum.ops[op][stat],
+				       (unsigned long long)sum.bytes[op][stat]);
+		DMEMIT(" %llu", (unsigned long long)config_read(dc, generation));
 		break;
 
 	case STATUSTYPE_TABLE:
+		rcu_read_lock();
+		cfg = rcu_dereference(dc->config);
 		DMEMIT("%s %llu %u", dc->dev_read->name,
 		       (unsigned long long) dc->start_read,
-		       dc->read_delay);
+		       cfg->read_delay);
 		if (dc->dev_write)
 			DMEMIT(" %s %llu %u", dc->dev_write->name,
 			       (unsigned long long) dc->start_write,
-			       dc->write_delay);
+			       cfg->write_delay);
+		rcu_read_unlock();
 		break;
 	}
 }
@@ -494,14 +4192,17 @@ out:
 
 static struct target_type delay_target = {
 	.name	     = "ddi",
-	.version     = {1, 2, 1},
+	.version     = {1, 3, 0},
 	.module      = THIS_MODULE,
 	.ctr	     = delay_ctr,
 	.dtr	     = delay_dtr,
 	.map	     = delay_map,
+	.end_io	     = delay_end_io,
 	.presuspend  = delay_presuspend,
+	.preresume   = delay_preresume,
 	.resume	     = delay_resume,
 	.status	     = delay_status,
+	.message     = delay_message,
 	.iterate_devices = delay_iterate_devices,
 };
 
@@ -516,17 +4217,39 @@ static int __init dm_delay_init(void)
 	}
 
 	ddi_kobj = kobject_create_and_add("ddi", fs_kobj);
-	if (!ddi_kobj)
-		return -ENOMEM;
+	if (!ddi_kobj) {
+		r = -ENOMEM;
+		goto bad_kobj;
+	}
+
+	groups_kobj = kobject_create_and_add("groups", ddi_kobj);
+	if (!groups_kobj) {
+		r = -ENOMEM;
+		goto bad_groups;
+	}
+	r = sysfs_create_group(groups_kobj, &groups_attr_group);
+	if (r)
+		goto bad_groups_attrs;
+
+	ddi_debugfs = debugfs_create_dir("ddi", NULL);
 
 	return 0;
 
+bad_groups_attrs:
+	kobject_put(groups_kobj);
+bad_groups:
+	kobject_put(ddi_kobj);
+bad_kobj:
+	dm_unregister_target(&delay_target);
 bad_register:
 	return r;
 }
 
 static void __exit dm_delay_exit(void)
 {
+	debugfs_remove_recursive(ddi_debugfs);
+	destroy_groups();
+	kobject_put(groups_kobj);
 	kobject_put(ddi_kobj);
 	dm_unregister_target(&delay_target);
 }